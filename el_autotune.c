@@ -0,0 +1,335 @@
+// el_autotune.c: Configuration autotuner for el_malloc(). Replays an
+// allocation trace recorded with EL_MALLOC_CONF=trace:PATH against a
+// grid of allocator configurations and ranks them by a weighted score of
+// throughput, 99th percentile operation latency and peak resident heap
+// memory. The best configuration is printed as a string that can be
+// placed in EL_MALLOC_CONF.
+//
+// Usage: el_autotune <trace> [w_throughput w_p99 w_rss]
+//
+// Weights default to 1 each. Scores are relative to the best value seen
+// for each metric so a score of 1.0 means best on every metric; lower is
+// better. Configurations for which an allocation failed are ranked last.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "el_malloc.h"
+
+// Grid of configurations that are tried
+char *fits[] = {"first", "best"};
+size_t split_mins[] = {0, 16, 32, 64, 128, 256};
+#define NFITS       (sizeof(fits) / sizeof(fits[0]))
+#define NSPLITS     (sizeof(split_mins) / sizeof(split_mins[0]))
+#define NCONFS      (NFITS * NSPLITS)
+
+// events between samples of the resident heap during a replay
+#define RSS_SAMPLE_EVENTS 1024
+
+// One operation of the trace; addresses in the trace are replaced by
+// dense slot numbers so the replay can index an array.
+typedef struct {
+    char op;                    // 'm', 'r' (in place growth), 'c' (commit) or 'f'
+    long slot;
+    size_t size;
+} event_t;
+
+typedef struct {
+    char conf[64];
+    double throughput;          // operations per second
+    double p99;                 // nanoseconds
+    size_t rss;                 // peak bytes of heap resident during the replay
+    long failed;                // allocations which returned NULL
+    double score;
+} result_t;
+
+event_t *events = NULL;
+long nevents = 0;
+long nslots = 0;
+
+// Open addressing map from traced address to the slot currently live
+// at that address.
+typedef struct {
+    unsigned long addr;
+    long slot;
+} addr_slot_t;
+
+addr_slot_t *amap = NULL;
+size_t amap_size = 0;
+
+addr_slot_t *amap_find(unsigned long addr) {
+    size_t i = (addr * 0x9E3779B97F4A7C15UL) & (amap_size - 1);
+    while (amap[i].addr != 0 && amap[i].addr != addr) {
+        i = (i + 1) & (amap_size - 1);
+    }
+    return &amap[i];
+}
+
+// malloc() that ends the run if memory for the trace runs out
+void *xmalloc(size_t nbytes) {
+    void *ptr = malloc(nbytes);
+    if (ptr == NULL) {
+        fprintf(stderr, "el_autotune: out of memory for %lu bytes\n", nbytes);
+        exit(1);
+    }
+    return ptr;
+}
+
+// Load the trace in path into events; returns -1 on error
+int load_trace(char *path) {
+    FILE *fin = fopen(path, "r");
+    if (fin == NULL) {
+        perror(path);
+        return -1;
+    }
+    long cap = 1024;
+    events = xmalloc(cap * sizeof(event_t));
+    char op;
+    unsigned long addr;
+    size_t size;
+    int nread;
+    while ((nread = fscanf(fin, " %c %lx", &op, &addr)) == 2) {
+        if (nevents == cap) {
+            event_t *more = realloc(events, 2 * cap * sizeof(event_t));
+            if (more == NULL) {
+                fprintf(stderr, "el_autotune: out of memory for %ld events\n", 2 * cap);
+                exit(1);
+            }
+            events = more;
+            cap *= 2;
+        }
+        event_t *ev = &events[nevents];
+        ev->op = op;
+        if (op == 'm') {
+            if (fscanf(fin, "%lu", &size) != 1) {
+                break;
+            }
+            ev->size = size;
+            ev->slot = nslots++;
+        } else if (op == 'r' || op == 'c') {
+            if (fscanf(fin, "%lu", &size) != 1) {
+                break;
+            }
+            ev->size = size;
+            ev->slot = -1;
+        } else if (op == 'f') {
+            ev->size = 0;
+            ev->slot = -1;
+        } else {
+            fprintf(stderr, "%s: bad operation '%c' at event %ld\n", path, op, nevents);
+            fclose(fin);
+            return -1;
+        }
+        nevents++;
+    }
+    fclose(fin);
+
+    // second pass resolves each free to the slot of the malloc it frees
+    amap_size = 1024;
+    while (amap_size < 2 * (size_t) nevents) {
+        amap_size *= 2;
+    }
+    amap = calloc(amap_size, sizeof(addr_slot_t));
+    if (amap == NULL) {
+        fprintf(stderr, "el_autotune: out of memory for %lu addresses\n", amap_size);
+        exit(1);
+    }
+    fin = fopen(path, "r");
+    if (fin == NULL) {
+        perror(path);
+        free(amap);
+        return -1;
+    }
+    for (long i = 0; i < nevents; i++) {
+        if (fscanf(fin, " %c %lx", &op, &addr) != 2) {
+            break;
+        }
+        addr_slot_t *entry = amap_find(addr);
+        if (op == 'm') {
+            if (fscanf(fin, "%lu", &size) != 1) {
+                break;
+            }
+            entry->addr = addr;
+            entry->slot = events[i].slot;
+        } else if (op == 'r' || op == 'c') {
+            if (fscanf(fin, "%lu", &size) != 1) {
+                break;
+            }
+            if (entry->addr == addr) {
+                events[i].slot = entry->slot;
+            }
+        } else if (entry->addr == addr) {
+            events[i].slot = entry->slot;
+            entry->slot = -1;   // keep addr so probing stays intact
+        }
+    }
+    fclose(fin);
+    free(amap);
+    return 0;
+}
+
+long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int compare_long(const void *a, const void *b) {
+    long x = *(long *) a, y = *(long *) b;
+    return (x > y) - (x < y);
+}
+
+// Count the heap pages that are resident
+size_t heap_resident_bytes() {
+    long page = sysconf(_SC_PAGESIZE);
+    size_t npages = (el_ctl.heap_bytes + page - 1) / page;
+    unsigned char *vec = xmalloc(npages);
+    size_t resident = 0;
+    if (mincore(el_ctl.heap_start, el_ctl.heap_bytes, vec) == 0) {
+        for (size_t i = 0; i < npages; i++) {
+            resident += vec[i] & 1;
+        }
+    }
+    free(vec);
+    return resident * page;
+}
+
+// Replay the whole trace on a fresh heap with the given configuration.
+// The resident heap is sampled every RSS_SAMPLE_EVENTS events and at the
+// end, keeping the peak; time spent sampling is not counted.
+int replay(char *conf, result_t *res, void **slots, long *lat) {
+    if (el_init() != 0 || el_set_conf(conf) != 0) {
+        return -1;
+    }
+    strncpy(res->conf, conf, sizeof(res->conf) - 1);
+    res->failed = 0;
+    memset(slots, 0, nslots * sizeof(void *));
+    res->rss = 0;
+    long sampling = 0;
+
+    long start = now_ns();
+    for (long i = 0; i < nevents; i++) {
+        event_t *ev = &events[i];
+        long t0 = now_ns();
+        if (ev->op == 'm') {
+            slots[ev->slot] = el_malloc(ev->size);
+            res->failed += slots[ev->slot] == NULL;
+        } else if (ev->op == 'r') {
+            if (ev->slot >= 0 && slots[ev->slot] != NULL) {
+                void *moved = el_realloc(slots[ev->slot], ev->size);
+                res->failed += moved == NULL;
+                slots[ev->slot] = moved != NULL ? moved : slots[ev->slot];
+            }
+        } else if (ev->op == 'c') {
+            if (ev->slot >= 0 && slots[ev->slot] != NULL) {
+                el_commit(slots[ev->slot], ev->size);
+            }
+        } else if (ev->slot >= 0 && slots[ev->slot] != NULL) {
+            el_free(slots[ev->slot]);
+            slots[ev->slot] = NULL;
+        }
+        lat[i] = now_ns() - t0;
+        if (i % RSS_SAMPLE_EVENTS == RSS_SAMPLE_EVENTS - 1) {
+            long s0 = now_ns();
+            size_t rss = heap_resident_bytes();
+            res->rss = rss > res->rss ? rss : res->rss;
+            sampling += now_ns() - s0;
+        }
+    }
+    long total = now_ns() - start - sampling;
+
+    res->throughput = nevents / (total * 1e-9);
+    qsort(lat, nevents, sizeof(long), compare_long);
+    res->p99 = lat[(long) (nevents * 0.99)];
+    size_t rss = heap_resident_bytes();
+    res->rss = rss > res->rss ? rss : res->rss;
+    el_cleanup();
+    return 0;
+}
+
+int compare_result(const void *a, const void *b) {
+    const result_t *x = a, *y = b;
+    if ((x->failed > 0) != (y->failed > 0)) {
+        return x->failed > 0 ? 1 : -1;
+    }
+    return (x->score > y->score) - (x->score < y->score);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 5) {
+        printf("Usage: %s <trace> [w_throughput w_p99 w_rss]\n", argv[0]);
+        return 1;
+    }
+    double w_thr = 1, w_p99 = 1, w_rss = 1;
+    if (argc == 5) {
+        w_thr = atof(argv[2]);
+        w_p99 = atof(argv[3]);
+        w_rss = atof(argv[4]);
+    }
+    if (w_thr + w_p99 + w_rss <= 0) {
+        printf("weights must not all be zero\n");
+        return 1;
+    }
+    unsetenv(EL_CONF_ENV);      // candidates alone decide the configuration
+
+    if (load_trace(argv[1]) != 0) {
+        return 1;
+    }
+    if (nevents == 0) {
+        printf("%s: empty trace\n", argv[1]);
+        return 1;
+    }
+    printf("trace: %ld events, %ld allocations, heap: %lu bytes\n",
+           nevents, nslots, (size_t) EL_HEAP_INITIAL_SIZE);
+
+    void **slots = xmalloc(nslots * sizeof(void *));
+    long *lat = xmalloc(nevents * sizeof(long));
+    result_t results[NCONFS];
+    int nres = 0;
+    for (int f = 0; f < NFITS; f++) {
+        for (int s = 0; s < NSPLITS; s++) {
+            char conf[64];
+            snprintf(conf, sizeof(conf), "fit:%s,split_min:%lu", fits[f], split_mins[s]);
+            if (replay(conf, &results[nres], slots, lat) == 0) {
+                nres++;
+            }
+        }
+    }
+    if (nres == 0) {
+        printf("no configuration could be replayed\n");
+        return 1;
+    }
+
+    double best_thr = 0, best_p99 = 0, best_rss = 0;
+    for (int i = 0; i < nres; i++) {
+        result_t *r = &results[i];
+        best_thr = r->throughput > best_thr ? r->throughput : best_thr;
+        best_p99 = best_p99 == 0 || r->p99 < best_p99 ? r->p99 : best_p99;
+        best_rss = best_rss == 0 || r->rss < best_rss ? r->rss : best_rss;
+    }
+    for (int i = 0; i < nres; i++) {
+        result_t *r = &results[i];
+        r->score = (w_thr * best_thr / r->throughput +
+                    w_p99 * (r->p99 > 0 ? r->p99 / best_p99 : 1) +
+                    w_rss * (r->rss > 0 ? r->rss / best_rss : 1)) /
+                   (w_thr + w_p99 + w_rss);
+    }
+    qsort(results, nres, sizeof(result_t), compare_result);
+
+    printf("%-4s %-28s %12s %8s %10s %8s %7s\n",
+           "rank", "configuration", "ops/sec", "p99_ns", "peak_kb", "failed", "score");
+    for (int i = 0; i < nres; i++) {
+        result_t *r = &results[i];
+        printf("%4d %-28s %12.0f %8.0f %10lu %8ld %7.3f\n", i + 1, r->conf,
+               r->throughput, r->p99, r->rss / 1024, r->failed, r->score);
+    }
+    printf("%s=%s\n", EL_CONF_ENV, results[0].conf);
+
+    free(slots);
+    free(lat);
+    free(events);
+    return 0;
+}
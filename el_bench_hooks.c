@@ -0,0 +1,160 @@
+// el_bench_hooks.c: Overhead of the allocation event hooks. Times
+// el_malloc()/el_realloc()/el_free() on a mix of sizes with no hooks
+// set, with hooks that do nothing and with hooks keeping per-size-class
+// counts as a simple profiler would. Built a second time against an
+// el_malloc.c compiled with -DEL_NO_HOOKS (el_bench_hooks_off) which
+// gives the cost with the hook checks removed altogether.
+//
+// Usage: el_bench_hooks [ops] [rounds]
+//
+// Each configuration is run rounds times and the fastest run is
+// reported to suppress noise.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "el_malloc.h"
+
+#define DEFAULT_OPS    2000000
+#define DEFAULT_ROUNDS 5
+#define NSLOTS         1024
+#define NCLASSES       16
+
+// Small xorshift generator so runs are repeatable
+unsigned long rng_state = 88172645463325252UL;
+
+unsigned long rng_next() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Counts kept by the profiling hooks
+typedef struct {
+    long mallocs[NCLASSES];
+    long bytes[NCLASSES];
+    long frees;
+    long reallocs;
+} profile_t;
+
+profile_t profile;
+
+int size_class(size_t nbytes) {
+    int c = 0;
+    while (nbytes > 16 && c < NCLASSES - 1) {
+        nbytes >>= 1;
+        c++;
+    }
+    return c;
+}
+
+void empty_malloc(void *ptr, size_t nbytes, void *arg) {}
+void empty_free(void *ptr, void *arg) {}
+void empty_realloc(void *old_ptr, void *new_ptr, size_t nbytes, void *arg) {}
+
+void profile_malloc(void *ptr, size_t nbytes, void *arg) {
+    profile_t *p = arg;
+    int c = size_class(nbytes);
+    p->mallocs[c]++;
+    p->bytes[c] += nbytes;
+}
+
+void profile_free(void *ptr, void *arg) {
+    ((profile_t *) arg)->frees++;
+}
+
+void profile_realloc(void *old_ptr, void *new_ptr, size_t nbytes, void *arg) {
+    ((profile_t *) arg)->reallocs++;
+}
+
+// Run ops operations on a pool of slots, each a malloc of 16 to 528
+// bytes into an empty slot, a free of a full slot or now and then a
+// realloc of it. Returns the time taken in seconds.
+double run(long ops) {
+    void *slots[NSLOTS] = {};
+    rng_state = 88172645463325252UL;
+    double start = now_sec();
+    for (long i = 0; i < ops; i++) {
+        unsigned long r = rng_next();
+        int k = r % NSLOTS;
+        if (slots[k] == NULL) {
+            slots[k] = el_malloc(16 + (r >> 16) % 513);
+        } else if ((r >> 32) % 8 == 0) {
+            void *moved = el_realloc(slots[k], 16 + (r >> 16) % 1025);
+            slots[k] = moved != NULL ? moved : slots[k];
+        } else {
+            el_free(slots[k]);
+            slots[k] = NULL;
+        }
+    }
+    double elapsed = now_sec() - start;
+    for (int k = 0; k < NSLOTS; k++) {
+        if (slots[k] != NULL) {
+            el_free(slots[k]);
+        }
+    }
+    return elapsed;
+}
+
+// Best time of rounds runs with the given hooks, NULL for none
+double best_of(long ops, int rounds, el_hooks_t *hooks) {
+    if (el_set_hooks(hooks) != 0) {
+        return -1;
+    }
+    double best = 0;
+    for (int r = 0; r < rounds; r++) {
+        double t = run(ops);
+        best = r == 0 || t < best ? t : best;
+    }
+    el_set_hooks(NULL);
+    return best;
+}
+
+void report(char *name, long ops, double secs, double base) {
+    if (secs < 0) {
+        printf("%-14s %10s %10s\n", name, "n/a", "n/a");
+    } else {
+        printf("%-14s %10.2f %+9.1f%%\n", name, secs * 1e9 / ops, (secs / base - 1) * 100);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    long ops = argc > 1 ? atol(argv[1]) : DEFAULT_OPS;
+    int rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+    if (ops <= 0 || rounds <= 0) {
+        printf("Usage: %s [ops] [rounds]\n", argv[0]);
+        return 1;
+    }
+    if (el_init() != 0) {
+        return 1;
+    }
+
+    printf("ops: %ld  rounds: %d\n", ops, rounds);
+    printf("%-14s %10s %10s\n", "hooks", "ns/op", "vs none");
+    double none = best_of(ops, rounds, NULL);
+#ifdef EL_NO_HOOKS
+    report("compiled out", ops, none, none);
+#else
+    el_hooks_t empty = {empty_malloc, empty_free, empty_realloc, NULL};
+    el_hooks_t prof = {profile_malloc, profile_free, profile_realloc, &profile};
+    report("none", ops, none, none);
+    report("empty", ops, best_of(ops, rounds, &empty), none);
+    report("profiler", ops, best_of(ops, rounds, &prof), none);
+
+    long mallocs = 0;
+    for (int c = 0; c < NCLASSES; c++) {
+        mallocs += profile.mallocs[c];
+    }
+    printf("profiled: %ld mallocs  %ld frees  %ld reallocs\n",
+           mallocs, profile.frees, profile.reallocs);
+#endif
+    el_cleanup();
+    return 0;
+}
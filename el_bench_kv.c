@@ -0,0 +1,358 @@
+// el_bench_kv.c: Application-level benchmark. A small in-memory
+// key-value store (chained hash map, variable length keys and values)
+// driven by GET/SET/DEL operations on Zipfian distributed keys. Every
+// allocation of the store goes through a pair of function pointers so
+// the same binary can run on el_malloc() or on glibc malloc().
+//
+// Usage: el_bench_kv [el|glibc] [keys] [ops]
+//
+// With no allocator named both are run, each in a forked child so that
+// the RSS figures of one do not include the other, and the results are
+// printed side by side.
+
+#include <malloc.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "el_malloc.h"
+
+#define DEFAULT_KEYS   50000
+#define DEFAULT_OPS    2000000
+#define ZIPF_THETA     0.99
+#define MIN_KEY_LEN    8
+#define MAX_KEY_LEN    40
+#define MIN_VAL_LEN    16
+#define MAX_VAL_LEN    512
+#define GET_PERCENT    90
+#define SET_PERCENT    8        // remainder are DEL
+
+// Allocator in use by the store
+void *(*kv_malloc)(size_t) = NULL;
+void (*kv_free)(void *) = NULL;
+
+// Entry in the store; the key is stored inline after the struct and the
+// value in a separate allocation so a SET replaces it independently.
+typedef struct entry {
+    struct entry *next;
+    unsigned long hash;
+    char *val;
+    int klen;
+    int vlen;
+    char key[];
+} entry_t;
+
+typedef struct {
+    entry_t **buckets;
+    size_t nbuckets;            // power of 2
+    size_t count;               // number of keys present
+    size_t payload;             // bytes of keys and values present
+} kv_t;
+
+// Small xorshift generator so runs are repeatable
+unsigned long rng_state = 88172645463325252UL;
+
+unsigned long rng_next() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+double rng_unit() {
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Zipfian generator over [0,n) following Gray et al. "Quickly Generating
+// Billion-Record Synthetic Databases" as used by YCSB.
+typedef struct {
+    long n;
+    double theta, alpha, zetan, eta;
+} zipf_t;
+
+void zipf_init(zipf_t *z, long n, double theta) {
+    double zeta2 = 0;
+    z->n = n;
+    z->theta = theta;
+    z->zetan = 0;
+    for (long i = 1; i <= n; i++) {
+        z->zetan += 1.0 / pow((double) i, theta);
+        if (i == 2) {
+            zeta2 = z->zetan;
+        }
+    }
+    z->alpha = 1.0 / (1.0 - theta);
+    z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+long zipf_next(zipf_t *z) {
+    double u = rng_unit();
+    double uz = u * z->zetan;
+    if (uz < 1.0) {
+        return 0;
+    }
+    if (uz < 1.0 + pow(0.5, z->theta)) {
+        return 1;
+    }
+    long r = (long) (z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return r < z->n ? r : z->n - 1;
+}
+
+// Keys are derived from the key number so every run sees the same key
+// strings and lengths; hash spreads hot keys over the table.
+int make_key(long num, char *buf) {
+    unsigned long h = (unsigned long) num * 0x9E3779B97F4A7C15UL;
+    int len = MIN_KEY_LEN + h % (MAX_KEY_LEN - MIN_KEY_LEN + 1);
+    int pos = snprintf(buf, MAX_KEY_LEN + 1, "key:%ld:", num);
+    for (; pos < len; pos++) {
+        buf[pos] = 'a' + (h >> (pos % 32)) % 26;
+    }
+    return len;
+}
+
+unsigned long hash_key(char *key, int len) {
+    unsigned long h = 1469598103934665603UL; // FNV-1a
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) key[i]) * 1099511628211UL;
+    }
+    return h;
+}
+
+// Store operations
+
+int kv_init(kv_t *kv, size_t nkeys) {
+    kv->nbuckets = 1;
+    while (kv->nbuckets < nkeys) {
+        kv->nbuckets *= 2;
+    }
+    kv->buckets = kv_malloc(kv->nbuckets * sizeof(entry_t *));
+    if (kv->buckets == NULL) {
+        return -1;
+    }
+    memset(kv->buckets, 0, kv->nbuckets * sizeof(entry_t *));
+    kv->count = 0;
+    kv->payload = 0;
+    return 0;
+}
+
+entry_t **kv_find(kv_t *kv, char *key, int klen, unsigned long hash) {
+    entry_t **link = &kv->buckets[hash & (kv->nbuckets - 1)];
+    for (; *link != NULL; link = &(*link)->next) {
+        entry_t *e = *link;
+        if (e->hash == hash && e->klen == klen && memcmp(e->key, key, klen) == 0) {
+            break;
+        }
+    }
+    return link;
+}
+
+char *kv_get(kv_t *kv, char *key, int klen, int *vlen) {
+    entry_t *e = *kv_find(kv, key, klen, hash_key(key, klen));
+    if (e == NULL) {
+        return NULL;
+    }
+    *vlen = e->vlen;
+    return e->val;
+}
+
+// Returns 0 on success and -1 if the allocator ran out of memory
+int kv_set(kv_t *kv, char *key, int klen, char *val, int vlen) {
+    unsigned long hash = hash_key(key, klen);
+    entry_t **link = kv_find(kv, key, klen, hash);
+    char *copy = kv_malloc(vlen);
+    if (copy == NULL) {
+        return -1;
+    }
+    memcpy(copy, val, vlen);
+    entry_t *e = *link;
+    if (e != NULL) {
+        kv->payload += vlen - e->vlen;
+        kv_free(e->val);
+        e->val = copy;
+        e->vlen = vlen;
+        return 0;
+    }
+    e = kv_malloc(sizeof(entry_t) + klen);
+    if (e == NULL) {
+        kv_free(copy);
+        return -1;
+    }
+    e->next = NULL;
+    e->hash = hash;
+    e->val = copy;
+    e->klen = klen;
+    e->vlen = vlen;
+    memcpy(e->key, key, klen);
+    *link = e;
+    kv->count++;
+    kv->payload += klen + vlen;
+    return 0;
+}
+
+int kv_del(kv_t *kv, char *key, int klen) {
+    entry_t **link = kv_find(kv, key, klen, hash_key(key, klen));
+    entry_t *e = *link;
+    if (e == NULL) {
+        return 0;
+    }
+    *link = e->next;
+    kv->count--;
+    kv->payload -= e->klen + e->vlen;
+    kv_free(e->val);
+    kv_free(e);
+    return 1;
+}
+
+// Process memory
+
+// Read a field such as VmRSS or VmHWM from /proc/self/status in kB
+long proc_status_kb(char *field) {
+    FILE *fin = fopen("/proc/self/status", "r");
+    if (fin == NULL) {
+        return -1;
+    }
+    char line[256];
+    long kb = -1;
+    size_t flen = strlen(field);
+    while (fgets(line, sizeof(line), fin) != NULL) {
+        if (strncmp(line, field, flen) == 0 && line[flen] == ':') {
+            kb = atol(line + flen + 1);
+            break;
+        }
+    }
+    fclose(fin);
+    return kb;
+}
+
+// Bytes currently handed out by the allocator including its per block
+// overhead.
+size_t allocator_bytes(int use_el) {
+    if (use_el) {
+        return el_ctl.used->bytes;
+    }
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks;
+}
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Run the whole benchmark on one allocator and print one result line
+int run(int use_el, long nkeys, long nops) {
+    if (use_el) {
+        if (el_init() != 0) {
+            return 1;
+        }
+        kv_malloc = el_malloc;
+        kv_free = el_free;
+    } else {
+        kv_malloc = malloc;
+        kv_free = free;
+    }
+    long rss_before = proc_status_kb("VmRSS");
+    size_t bytes_before = allocator_bytes(use_el);
+
+    kv_t kv;
+    if (kv_init(&kv, nkeys) != 0) {
+        printf("%-6s out of memory building table\n", use_el ? "el" : "glibc");
+        return 1;
+    }
+    zipf_t zipf;
+    zipf_init(&zipf, nkeys, ZIPF_THETA);
+    char key[MAX_KEY_LEN + 1];
+    char val[MAX_VAL_LEN];
+    memset(val, 'v', sizeof(val));
+
+    long failed = 0;
+    for (long k = 0; k < nkeys; k++) {    // preload every key once
+        int klen = make_key(k, key);
+        int vlen = MIN_VAL_LEN + rng_next() % (MAX_VAL_LEN - MIN_VAL_LEN + 1);
+        failed += kv_set(&kv, key, klen, val, vlen) != 0;
+    }
+
+    long gets = 0, hits = 0, sets = 0, dels = 0;
+    long checksum = 0;
+    double start = now_sec();
+    for (long i = 0; i < nops; i++) {
+        long k = zipf_next(&zipf);
+        int klen = make_key(k, key);
+        int op = rng_next() % 100;
+        if (op < GET_PERCENT) {
+            int vlen;
+            char *v = kv_get(&kv, key, klen, &vlen);
+            gets++;
+            if (v != NULL) {
+                hits++;
+                checksum += v[vlen - 1];
+            }
+        } else if (op < GET_PERCENT + SET_PERCENT) {
+            int vlen = MIN_VAL_LEN + rng_next() % (MAX_VAL_LEN - MIN_VAL_LEN + 1);
+            failed += kv_set(&kv, key, klen, val, vlen) != 0;
+            sets++;
+        } else {
+            dels += kv_del(&kv, key, klen);
+        }
+    }
+    double secs = now_sec() - start;
+
+    size_t bytes = allocator_bytes(use_el) - bytes_before;
+    double overhead = kv.count > 0 ?
+        ((double) bytes - (double) kv.payload) / kv.count : 0;
+    long rss = proc_status_kb("VmRSS");
+    long hwm = proc_status_kb("VmHWM");
+
+    printf("%-6s %12.0f %10.1f %10ld %10ld %8ld %8ld\n",
+           use_el ? "el" : "glibc", nops / secs, overhead,
+           rss - rss_before, hwm, failed, checksum % 1000);
+    fflush(stdout);
+    if (use_el) {
+        el_cleanup();
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int argi = 1;
+    int which = -1;             // -1 for both, else use_el
+    if (argc > 1 && strcmp(argv[1], "el") == 0) {
+        which = 1;
+        argi++;
+    } else if (argc > 1 && strcmp(argv[1], "glibc") == 0) {
+        which = 0;
+        argi++;
+    }
+    long nkeys = argc > argi ? atol(argv[argi]) : DEFAULT_KEYS;
+    long nops = argc > argi + 1 ? atol(argv[argi + 1]) : DEFAULT_OPS;
+    if (nkeys < 2 || nops <= 0) {
+        printf("Usage: %s [el|glibc] [keys] [ops]\n", argv[0]);
+        return 1;
+    }
+
+    printf("keys: %ld  ops: %ld  get/set/del: %d/%d/%d  zipf theta: %.2f\n",
+           nkeys, nops, GET_PERCENT, SET_PERCENT, 100 - GET_PERCENT - SET_PERCENT,
+           ZIPF_THETA);
+    printf("%-6s %12s %10s %10s %10s %8s %8s\n", "alloc", "ops/sec",
+           "ovh/key", "rss_kb", "hwm_kb", "failed", "check");
+    fflush(stdout);
+    if (which >= 0) {
+        return run(which, nkeys, nops);
+    }
+
+    int status = 0;
+    for (int use_el = 1; use_el >= 0; use_el--) {
+        pid_t child = fork();
+        if (child == 0) {
+            return run(use_el, nkeys, nops);
+        }
+        int cstatus;
+        waitpid(child, &cstatus, 0);
+        status |= !WIFEXITED(cstatus) || WEXITSTATUS(cstatus) != 0;
+    }
+    return status;
+}
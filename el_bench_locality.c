@@ -0,0 +1,391 @@
+// el_bench_locality.c: Locality benchmark for el_malloc(). Builds linked
+// lists, binary trees and hash chains with el_malloc() under different
+// fragmentation states of the heap and then times traversals of them.
+// Cache misses and dTLB misses during each traversal are read with
+// perf_event_open() so that layout decisions of the allocator can be
+// judged by their effect on the application rather than on allocation
+// speed alone.
+//
+// Usage: el_bench_locality [nodes] [passes]
+//
+// Must be linked against a build of el_malloc.c with a large heap; see
+// the el_bench_locality target in the Makefile.
+
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "el_malloc.h"
+
+#define DEFAULT_NODES  100000
+#define DEFAULT_PASSES 10
+#define NBUCKETS       4096
+
+// States the heap is put into before building a structure
+typedef enum {
+    STATE_FRESH,                // heap is one large available block
+    STATE_HOLES,                // every other filler block was freed leaving regular holes
+    STATE_RANDOM,               // random fillers freed in random order
+    STATE_COUNT
+} heap_state_t;
+
+char *state_names[STATE_COUNT] = {"fresh", "holes", "random"};
+
+// Node types for the three structures
+typedef struct lnode {
+    struct lnode *next;
+    long key;
+} lnode_t;
+
+typedef struct tnode {
+    struct tnode *left;
+    struct tnode *right;
+    long key;
+} tnode_t;
+
+typedef struct hnode {
+    struct hnode *next;
+    long key;
+    long val;
+} hnode_t;
+
+// Small xorshift generator so runs are repeatable
+unsigned long rng_state = 88172645463325252UL;
+
+unsigned long rng_next() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Hardware counters
+
+// Open a counter for the calling thread on any cpu. Returns -1 if the
+// counter is not available (no PMU, perf_event_paranoid, containers...).
+int perf_open(unsigned int type, unsigned long config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int cache_fd = -1;
+int dtlb_fd = -1;
+
+void perf_start() {
+    if (cache_fd >= 0) {
+        ioctl(cache_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(cache_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    if (dtlb_fd >= 0) {
+        ioctl(dtlb_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(dtlb_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+// Stop counting and read the counter in fd; returns -1 if unavailable
+long perf_stop(int fd) {
+    long count = -1;
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+            count = -1;
+        }
+    }
+    return count;
+}
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// el_malloc() that stops the run if the heap is full rather than letting
+// a build dereference NULL; the fixed heap bounds the nodes a run can use
+void *bench_malloc(size_t nbytes) {
+    void *ptr = el_malloc(nbytes);
+    if (ptr == NULL) {
+        fprintf(stderr, "el_bench_locality: heap of %lu bytes is full, use fewer nodes\n",
+                el_ctl.heap_bytes);
+        exit(1);
+    }
+    return ptr;
+}
+
+// Heap preparation
+
+// Fillers allocated to fragment the heap; kept so they can be freed
+// after each run returns the heap to its starting state.
+void **fillers = NULL;
+int nfillers = 0;
+
+// Put the heap in the given state. Fillers are sized so that every hole
+// left behind can hold any node type which keeps el_find_first_avail()
+// from walking over holes that are too small.
+void prepare_heap(heap_state_t state, int nodes) {
+    nfillers = 0;
+    if (state == STATE_FRESH) {
+        return;
+    }
+    nfillers = nodes;
+    for (int i = 0; i < nfillers; i++) {
+        size_t size = 64 + 8 * (rng_next() % 56);
+        fillers[i] = bench_malloc(size);
+    }
+    if (state == STATE_HOLES) {
+        for (int i = 0; i < nfillers; i += 2) {
+            el_free(fillers[i]);
+            fillers[i] = NULL;
+        }
+    } else {
+        for (int i = nfillers - 1; i > 0; i--) { // shuffle then free half
+            int j = rng_next() % (i + 1);
+            void *tmp = fillers[i];
+            fillers[i] = fillers[j];
+            fillers[j] = tmp;
+        }
+        for (int i = 0; i < nfillers / 2; i++) {
+            el_free(fillers[i]);
+            fillers[i] = NULL;
+        }
+    }
+}
+
+void release_fillers() {
+    for (int i = 0; i < nfillers; i++) {
+        if (fillers[i] != NULL) {
+            el_free(fillers[i]);
+        }
+    }
+}
+
+// Structures; each build returns the root and each walk returns a
+// checksum so the traversal can not be optimized away.
+
+lnode_t *list_build(int nodes) {
+    lnode_t *head = NULL;
+    for (int i = 0; i < nodes; i++) {
+        lnode_t *node = bench_malloc(sizeof(lnode_t));
+        node->key = i;
+        node->next = head;
+        head = node;
+    }
+    return head;
+}
+
+long list_walk(lnode_t *head) {
+    long sum = 0;
+    for (; head != NULL; head = head->next) {
+        sum += head->key;
+    }
+    return sum;
+}
+
+void list_free(lnode_t *head) {
+    while (head != NULL) {
+        lnode_t *next = head->next;
+        el_free(head);
+        head = next;
+    }
+}
+
+tnode_t *tree_build(int nodes) {
+    tnode_t *root = NULL;
+    for (int i = 0; i < nodes; i++) {
+        tnode_t *node = bench_malloc(sizeof(tnode_t));
+        node->key = rng_next() % (nodes * 4L);
+        node->left = node->right = NULL;
+        tnode_t **link = &root;
+        while (*link != NULL) {
+            link = node->key < (*link)->key ? &(*link)->left : &(*link)->right;
+        }
+        *link = node;
+    }
+    return root;
+}
+
+// In-order walk with an explicit stack. Trees from random keys have
+// logarithmic expected depth but the stack doubles when a deep path
+// needs it so no subtree is ever skipped.
+long tree_walk(tnode_t *root) {
+    int cap = 256;
+    tnode_t **stack = malloc(cap * sizeof(tnode_t *));
+    int top = 0;
+    long sum = 0;
+    tnode_t *cur = root;
+    while (cur != NULL || top > 0) {
+        while (cur != NULL) {
+            if (top == cap) {
+                cap *= 2;
+                stack = realloc(stack, cap * sizeof(tnode_t *));
+            }
+            if (stack == NULL) {
+                fprintf(stderr, "el_bench_locality: out of memory for the tree walk\n");
+                exit(1);
+            }
+            stack[top++] = cur;
+            cur = cur->left;
+        }
+        cur = stack[--top];
+        sum += cur->key;
+        cur = cur->right;
+    }
+    free(stack);
+    return sum;
+}
+
+void tree_free(tnode_t *root) {
+    if (root != NULL) {
+        tree_free(root->left);
+        tree_free(root->right);
+        el_free(root);
+    }
+}
+
+hnode_t **hash_build(int nodes) {
+    hnode_t **buckets = bench_malloc(NBUCKETS * sizeof(hnode_t *));
+    memset(buckets, 0, NBUCKETS * sizeof(hnode_t *));
+    for (int i = 0; i < nodes; i++) {
+        hnode_t *node = bench_malloc(sizeof(hnode_t));
+        node->key = rng_next();
+        node->val = i;
+        int b = (unsigned long) node->key % NBUCKETS;
+        node->next = buckets[b];
+        buckets[b] = node;
+    }
+    return buckets;
+}
+
+// Probe every bucket chain to its end as a failed lookup would
+long hash_walk(hnode_t **buckets) {
+    long sum = 0;
+    for (int b = 0; b < NBUCKETS; b++) {
+        for (hnode_t *node = buckets[b]; node != NULL; node = node->next) {
+            sum += node->val;
+        }
+    }
+    return sum;
+}
+
+void hash_free(hnode_t **buckets) {
+    for (int b = 0; b < NBUCKETS; b++) {
+        hnode_t *node = buckets[b];
+        while (node != NULL) {
+            hnode_t *next = node->next;
+            el_free(node);
+            node = next;
+        }
+    }
+    el_free(buckets);
+}
+
+// Report one timed traversal result
+void report(char *structure, heap_state_t state, int nodes, int passes,
+            double secs, long misses, long tlb_misses) {
+    double per_node = secs * 1e9 / ((double) nodes * passes);
+    printf("%-6s %-7s %10.2f", structure, state_names[state], per_node);
+    if (misses >= 0) {
+        printf(" %12.3f", (double) misses / ((double) nodes * passes));
+    } else {
+        printf(" %12s", "n/a");
+    }
+    if (tlb_misses >= 0) {
+        printf(" %12.3f", (double) tlb_misses / ((double) nodes * passes));
+    } else {
+        printf(" %12s", "n/a");
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    int nodes = argc > 1 ? atoi(argv[1]) : DEFAULT_NODES;
+    int passes = argc > 2 ? atoi(argv[2]) : DEFAULT_PASSES;
+    if (nodes <= 0 || passes <= 0) {
+        printf("Usage: %s [nodes] [passes]\n", argv[0]);
+        return 1;
+    }
+
+    if (el_init() != 0) {
+        return 1;
+    }
+    fillers = malloc(nodes * sizeof(void *));
+    if (fillers == NULL) {
+        printf("Cannot allocate %d fillers\n", nodes);
+        return 1;
+    }
+
+    cache_fd = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    dtlb_fd = perf_open(PERF_TYPE_HW_CACHE,
+                        PERF_COUNT_HW_CACHE_DTLB |
+                        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    if (cache_fd < 0 || dtlb_fd < 0) {
+        printf("NOTE: some hardware counters are unavailable, reported as n/a\n");
+    }
+
+    printf("heap: %lu bytes, nodes: %d, passes: %d\n",
+           el_ctl.heap_bytes, nodes, passes);
+    printf("%-6s %-7s %10s %12s %12s\n",
+           "struct", "heap", "ns/node", "miss/node", "dtlb/node");
+
+    long checksum = 0;
+    for (heap_state_t state = 0; state < STATE_COUNT; state++) {
+        double start;
+        long misses, tlb_misses;
+
+        prepare_heap(state, nodes);
+        lnode_t *list = list_build(nodes);
+        start = now_sec();
+        perf_start();
+        for (int p = 0; p < passes; p++) {
+            checksum += list_walk(list);
+        }
+        misses = perf_stop(cache_fd);
+        tlb_misses = perf_stop(dtlb_fd);
+        report("list", state, nodes, passes, now_sec() - start, misses, tlb_misses);
+        list_free(list);
+        release_fillers();
+
+        prepare_heap(state, nodes);
+        tnode_t *tree = tree_build(nodes);
+        start = now_sec();
+        perf_start();
+        for (int p = 0; p < passes; p++) {
+            checksum += tree_walk(tree);
+        }
+        misses = perf_stop(cache_fd);
+        tlb_misses = perf_stop(dtlb_fd);
+        report("tree", state, nodes, passes, now_sec() - start, misses, tlb_misses);
+        tree_free(tree);
+        release_fillers();
+
+        prepare_heap(state, nodes);
+        hnode_t **hash = hash_build(nodes);
+        start = now_sec();
+        perf_start();
+        for (int p = 0; p < passes; p++) {
+            checksum += hash_walk(hash);
+        }
+        misses = perf_stop(cache_fd);
+        tlb_misses = perf_stop(dtlb_fd);
+        report("hash", state, nodes, passes, now_sec() - start, misses, tlb_misses);
+        hash_free(hash);
+        release_fillers();
+    }
+    printf("checksum: %ld\n", checksum);
+
+    free(fillers);
+    el_cleanup();
+    return 0;
+}
@@ -0,0 +1,194 @@
+// el_iobuf.c: scatter-gather buffer chains for zero-copy writev().
+
+#include <string.h>
+#include "el_malloc.h"
+#include "el_iobuf.h"
+
+static const size_t el_iobuf_classes[EL_IOBUF_NCLASSES] = EL_IOBUF_CLASSES;
+
+// number of segments handed to el_free_batch() at a time on release
+#define RELEASE_BATCH 64
+
+// Initialize buf to be an empty chain
+void el_iobuf_init(el_iobuf_t *buf) {
+  buf->head = NULL;
+  buf->tail = NULL;
+  buf->nsegs = 0;
+  buf->bytes = 0;
+}
+
+// Allocate an owned segment for len bytes of data from the smallest
+// size class that holds it or the largest class. Returns NULL if no
+// memory is available.
+static el_ioseg_t *seg_alloc(size_t len) {
+  size_t size = el_iobuf_classes[EL_IOBUF_NCLASSES - 1];
+  for (int i = 0; i < EL_IOBUF_NCLASSES; i++) {
+    if (len <= el_iobuf_classes[i]) {
+      size = el_iobuf_classes[i];
+      break;
+    }
+  }
+  el_ioseg_t *seg = el_malloc(sizeof(el_ioseg_t) + size);
+  if (seg == NULL) {
+    return NULL;
+  }
+  seg->next = NULL;
+  seg->buf_start = PTR_PLUS_BYTES(seg, sizeof(el_ioseg_t));
+  seg->buf_end = seg->buf_start + size;
+  seg->data = seg->buf_start;
+  seg->len = 0;
+  return seg;
+}
+
+static void link_tail(el_iobuf_t *buf, el_ioseg_t *seg) {
+  if (buf->tail == NULL) {
+    buf->head = seg;
+  } else {
+    buf->tail->next = seg;
+  }
+  buf->tail = seg;
+  buf->nsegs++;
+  buf->bytes += seg->len;
+}
+
+static void link_head(el_iobuf_t *buf, el_ioseg_t *seg) {
+  seg->next = buf->head;
+  buf->head = seg;
+  if (buf->tail == NULL) {
+    buf->tail = seg;
+  }
+  buf->nsegs++;
+  buf->bytes += seg->len;
+}
+
+// Append a copy of len bytes at data to the end of buf. Fills the spare
+// room of the last segment first and then adds segments. Returns 0 on
+// success and -1 if no memory is available; data that fit before memory
+// ran out stays appended.
+int el_iobuf_append(el_iobuf_t *buf, const void *data, size_t len) {
+  el_ioseg_t *tail = buf->tail;
+  if (tail != NULL && tail->buf_start != NULL) {
+    size_t room = tail->buf_end - (tail->data + tail->len);
+    size_t n = len < room ? len : room;
+    memcpy(tail->data + tail->len, data, n);
+    tail->len += n;
+    buf->bytes += n;
+    data = PTR_PLUS_BYTES(data, n);
+    len -= n;
+  }
+  while (len > 0) {
+    el_ioseg_t *seg = seg_alloc(len);
+    if (seg == NULL) {
+      return -1;
+    }
+    size_t n = seg->buf_end - seg->buf_start;
+    n = len < n ? len : n;
+    memcpy(seg->data, data, n);
+    seg->len = n;
+    link_tail(buf, seg);
+    data = PTR_PLUS_BYTES(data, n);
+    len -= n;
+  }
+  return 0;
+}
+
+// Prepend a copy of len bytes at data to the front of buf. Uses the
+// headroom of the first segment first; new segments place their data at
+// the end of the payload area so later prepends find headroom. Returns 0
+// on success and -1 if no memory is available.
+int el_iobuf_prepend(el_iobuf_t *buf, const void *data, size_t len) {
+  el_ioseg_t *head = buf->head;
+  if (head != NULL && head->buf_start != NULL) {
+    size_t room = head->data - head->buf_start;
+    size_t n = len < room ? len : room;
+    head->data -= n;
+    head->len += n;
+    buf->bytes += n;
+    memcpy(head->data, PTR_PLUS_BYTES(data, len - n), n);
+    len -= n;
+  }
+  while (len > 0) {
+    el_ioseg_t *seg = seg_alloc(len);
+    if (seg == NULL) {
+      return -1;
+    }
+    size_t n = seg->buf_end - seg->buf_start;
+    n = len < n ? len : n;
+    seg->data = seg->buf_end - n;
+    memcpy(seg->data, PTR_PLUS_BYTES(data, len - n), n);
+    seg->len = n;
+    link_head(buf, seg);
+    len -= n;
+  }
+  return 0;
+}
+
+// Allocate a segment referring to caller memory
+static el_ioseg_t *seg_ref(const void *data, size_t len) {
+  el_ioseg_t *seg = el_malloc(sizeof(el_ioseg_t));
+  if (seg != NULL) {
+    seg->next = NULL;
+    seg->data = (char *) data;
+    seg->len = len;
+    seg->buf_start = NULL;
+    seg->buf_end = NULL;
+  }
+  return seg;
+}
+
+// Append len bytes at data to buf without copying them. The memory must
+// stay valid and unchanged until buf is released. Returns 0 on success
+// and -1 if no memory is available for the segment.
+int el_iobuf_append_ref(el_iobuf_t *buf, const void *data, size_t len) {
+  el_ioseg_t *seg = seg_ref(data, len);
+  if (seg == NULL) {
+    return -1;
+  }
+  link_tail(buf, seg);
+  return 0;
+}
+
+// Prepend len bytes at data to buf without copying them; as for
+// el_iobuf_append_ref().
+int el_iobuf_prepend_ref(el_iobuf_t *buf, const void *data, size_t len) {
+  el_ioseg_t *seg = seg_ref(data, len);
+  if (seg == NULL) {
+    return -1;
+  }
+  link_head(buf, seg);
+  return 0;
+}
+
+// Fill up to max entries of iov with the non-empty segments of buf in
+// order, ready for writev() or sendmsg(). Returns the number of entries
+// filled; a chain of more than max segments is cut short.
+int el_iobuf_to_iovec(el_iobuf_t *buf, struct iovec *iov, int max) {
+  int n = 0;
+  for (el_ioseg_t *seg = buf->head; seg != NULL && n < max; seg = seg->next) {
+    if (seg->len > 0) {
+      iov[n].iov_base = seg->data;
+      iov[n].iov_len = seg->len;
+      n++;
+    }
+  }
+  return n;
+}
+
+// Return all segments of buf to the allocator in batches and leave buf
+// empty. Referenced memory is not touched.
+void el_iobuf_release(el_iobuf_t *buf) {
+  void *batch[RELEASE_BATCH];
+  size_t n = 0;
+  el_ioseg_t *seg = buf->head;
+  while (seg != NULL) {
+    el_ioseg_t *next = seg->next;
+    batch[n++] = seg;
+    if (n == RELEASE_BATCH) {
+      el_free_batch(batch, n);
+      n = 0;
+    }
+    seg = next;
+  }
+  el_free_batch(batch, n);
+  el_iobuf_init(buf);
+}
@@ -0,0 +1,46 @@
+#ifndef EL_IOBUF_H
+#define EL_IOBUF_H
+
+// Scatter-gather buffer chains. A chain is a list of segments which are
+// either el blocks holding copied data or references to memory owned by
+// the caller. Fragments are appended or prepended without moving data
+// already in the chain and the chain is handed to writev()/sendmsg() as
+// an iovec array. Releasing a chain frees all of its segments in one
+// el_free_batch() call.
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+// payload sizes of owned segments; a fragment gets the smallest class
+// that holds it and fragments beyond the largest span several segments
+#define EL_IOBUF_CLASSES   {256, 1024, 4096, 16384}
+#define EL_IOBUF_NCLASSES  4
+
+// One segment of a chain. Owned segments are a single el block with the
+// payload area right after this struct; for references buf_start and
+// buf_end are NULL.
+typedef struct el_ioseg {
+  struct el_ioseg *next;        // next segment in the chain
+  char *data;                   // first byte of data in this segment
+  size_t len;                   // bytes of data
+  char *buf_start;              // bounds of the payload area of owned segments
+  char *buf_end;
+} el_ioseg_t;
+
+typedef struct {
+  el_ioseg_t *head;             // first segment; NULL if empty
+  el_ioseg_t *tail;             // last segment
+  size_t nsegs;                 // number of segments
+  size_t bytes;                 // bytes of data in all segments
+} el_iobuf_t;
+
+// functions defined in el_iobuf.c
+void el_iobuf_init(el_iobuf_t *buf);
+int el_iobuf_append(el_iobuf_t *buf, const void *data, size_t len);
+int el_iobuf_prepend(el_iobuf_t *buf, const void *data, size_t len);
+int el_iobuf_append_ref(el_iobuf_t *buf, const void *data, size_t len);
+int el_iobuf_prepend_ref(el_iobuf_t *buf, const void *data, size_t len);
+int el_iobuf_to_iovec(el_iobuf_t *buf, struct iovec *iov, int max);
+void el_iobuf_release(el_iobuf_t *buf);
+
+#endif // EL_IOBUF_H
@@ -1,9 +1,15 @@
 // el_malloc.c: implementation of explicit list allocator functions.
 
-#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
 #include "el_malloc.h"
 
 // Global control functions
@@ -12,46 +18,330 @@
 // el_init().
 el_ctl_t el_ctl = {};
 
-// Create an initial block of memory for the heap using mmap(). Initialize the
-// el_ctl data structure to point at this block. The initial size/position of
-// the heap for the memory map are given in the symbols EL_HEAP_INITIAL_SIZE
-// and EL_HEAP_START_ADDRESS. Initialize the lists in el_ctl to contain a
-// single large block of available memory and no used blocks of memory.
-int el_init() {
-    void *heap = mmap(EL_HEAP_START_ADDRESS, EL_HEAP_INITIAL_SIZE,
-                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    assert(heap == EL_HEAP_START_ADDRESS);
+// Hooks set with el_set_hooks(); all NULL when none are set. EL_HOOK()
+// calls the given hook if one is set. The test is a load and a branch
+// predicted not taken so costs next to nothing without hooks.
+#ifdef EL_NO_HOOKS
+#define EL_HOOK(event, ...)
+#else
+static el_hooks_t el_hooks = {};
+
+#define EL_HOOK(event, ...)                                             \
+    do {                                                                \
+        if (__builtin_expect(el_hooks.event != NULL, 0)) {              \
+            el_hooks.event(__VA_ARGS__, el_hooks.arg);                  \
+        }                                                               \
+    } while (0)
+#endif
 
-    el_ctl.heap_bytes = EL_HEAP_INITIAL_SIZE; // make the heap as big as possible to begin with
-    el_ctl.heap_start = heap; // set addresses of start and end of heap
-    el_ctl.heap_end = PTR_PLUS_BYTES(heap, el_ctl.heap_bytes);
+// Monotonic counts of the usable bytes allocated and freed by each
+// thread; see el_thread_allocatedp()
+static __thread size_t el_thread_allocated = 0;
+static __thread size_t el_thread_deallocated = 0;
 
-    if (el_ctl.heap_bytes < EL_BLOCK_OVERHEAD) {
+// Per-thread log of the blocks allocated from el_ctl inside an allocation
+// scope; see el_txn_begin()
+typedef struct {
+    int active;                 // 1 between el_txn_begin() and commit/abort
+    void **ptrs;                // blocks allocated in the scope, kept with libc realloc()
+    size_t len;
+    size_t cap;
+} el_txn_log_t;
+
+static __thread el_txn_log_t el_txn = {};
+
+// Head of the Treiber stack of one cache size class. The tag is bumped by
+// every push and pop so a compare-and-swap of the whole head fails if the
+// top was popped and pushed again in between (ABA). The swap is a single
+// cmpxchg16b where the compiler provides one (-mcx16 on x86-64, see the
+// Makefile); elsewhere heads are swapped under el_cache_lock.
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_16
+#define EL_CACHE_CAS16
+#endif
+
+typedef union {
+    struct {
+        el_blockhead_t *top;    // most recently cached block; NULL if empty
+        unsigned long tag;
+    };
+#ifdef EL_CACHE_CAS16
+    unsigned __int128 word;     // both fields for cmpxchg16b
+#endif
+} el_cache_head_t;
+
+static el_cache_head_t el_cache[EL_CACHE_CLASSES] = {};
+
+#ifndef EL_CACHE_CAS16
+static el_lock_t el_cache_lock = {};
+#endif
+
+// Cached blocks are chained through the first word of their payload which
+// follows the block size so may be unaligned; it is copied in and out
+static el_blockhead_t *el_cache_link(el_blockhead_t *block) {
+    el_blockhead_t *next;
+    memcpy(&next, PTR_PLUS_BYTES(block, sizeof(el_blockhead_t)), sizeof(next));
+    return next;
+}
+
+static void el_cache_set_link(el_blockhead_t *block, el_blockhead_t *next) {
+    memcpy(PTR_PLUS_BYTES(block, sizeof(el_blockhead_t)), &next, sizeof(next));
+}
+
+static void el_sig_init();
+static void el_cold_forget(el_ctl_t *heap);
+static void el_ksm_forget(el_ctl_t *sub);
+static void el_cold_forget_all();
+
+// Set the configuration to the defaults and apply EL_MALLOC_CONF if it
+// is set. Returns 0 on success and -1 if the configuration is invalid.
+static int el_init_conf() {
+    el_ctl.fit = EL_FIT_FIRST;
+    el_ctl.split_min = 0;
+    el_ctl.trace = NULL;
+    el_ctl.cache_max = 0;
+    el_ctl.grow = 0;
+    el_ctl.budget = 0;
+    el_ctl.waiters = NULL;
+    el_ctl.waiters_tail = NULL;
+    el_ctl.mergeable = 0;
+    el_ctl.cold = 0;
+    el_ctl.cold_advice = MADV_COLD;
+    el_ctl.epoch = 0;
+    el_ctl.cold_blocks = 0;
+    el_ctl.cold_pages = 0;
+    el_lock_init(&el_ctl.lock);
+    char *conf = getenv(EL_CONF_ENV);
+    if (conf != NULL && el_set_conf(conf) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Set up heap to manage the bytes at mem as a single available block
+static int el_init_heap(el_ctl_t *heap, void *mem, size_t bytes) {
+    heap->heap_bytes = bytes; // make the heap as big as possible to begin with
+    heap->heap_start = mem; // set addresses of start and end of heap
+    heap->heap_end = PTR_PLUS_BYTES(mem, heap->heap_bytes);
+
+    if (heap->heap_bytes < EL_BLOCK_OVERHEAD) {
         fprintf(stderr,"el_init: heap size %ld to small for a block overhead %ld\n",
-                el_ctl.heap_bytes,EL_BLOCK_OVERHEAD);
+                heap->heap_bytes,EL_BLOCK_OVERHEAD);
         return -1;
     }
 
-    el_init_blocklist(&el_ctl.avail_actual);
-    el_init_blocklist(&el_ctl.used_actual);
-    el_ctl.avail = &el_ctl.avail_actual;
-    el_ctl.used = &el_ctl.used_actual;
+    el_init_blocklist(&heap->avail_actual);
+    el_init_blocklist(&heap->used_actual);
+    heap->avail = &heap->avail_actual;
+    heap->used = &heap->used_actual;
 
     // establish the first available block by filling in size in
     // block/foot and null links in head
-    size_t size = el_ctl.heap_bytes - EL_BLOCK_OVERHEAD;
-    el_blockhead_t *ablock = el_ctl.heap_start;
+    size_t size = heap->heap_bytes - EL_BLOCK_OVERHEAD;
+    el_blockhead_t *ablock = heap->heap_start;
     ablock->size = size;
     ablock->state = EL_AVAILABLE;
     el_blockfoot_t *afoot = el_get_footer(ablock);
     afoot->size = size;
-    el_add_block_front(el_ctl.avail, ablock);
+    el_add_block_front(heap->avail, ablock);
+    ablock->purged = 0;
+    heap->purged_pages = 0;
     return 0;
 }
 
+// Create an initial block of memory for the heap using mmap(). Initialize the
+// el_ctl data structure to point at this block. The initial size/position of
+// the heap for the memory map are given in the symbols EL_HEAP_INITIAL_SIZE
+// and EL_HEAP_START_ADDRESS. Initialize the lists in el_ctl to contain a
+// single large block of available memory and no used blocks of memory.
+// Allocator options start at their defaults and are then set from the
+// EL_CONF_ENV environment variable if present; returns -1 if that
+// string is not valid.
+int el_init() {
+    if (el_init_conf() != 0) {
+        return -1;
+    }
+
+    // the heap is always at the same address so block addresses repeat
+    // from run to run; refuse to start anywhere else
+    void *heap = mmap(EL_HEAP_START_ADDRESS, EL_HEAP_INITIAL_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (heap != EL_HEAP_START_ADDRESS) {
+        fprintf(stderr,"el_init: cannot map heap at %p\n", EL_HEAP_START_ADDRESS);
+        if (heap != MAP_FAILED) {
+            munmap(heap, EL_HEAP_INITIAL_SIZE);
+        }
+        return -1;
+    }
+
+    el_ctl.heap_owned = 1;
+    el_ctl.parent = NULL;
+    el_sig_init();
+    if (el_init_heap(&el_ctl, heap, EL_HEAP_INITIAL_SIZE) != 0) {
+        return -1;
+    }
+    // freshly mapped pages are not resident until touched
+    el_blockhead_t *ablock = el_ctl.heap_start;
+    ablock->purged = el_block_pages(ablock);
+    el_ctl.purged_pages = ablock->purged;
+    return 0;
+}
+
+// Initialize the allocator to run over the size bytes at buf supplied by
+// the caller, such as a static array or a buffer on the stack, instead
+// of mapping a heap. No system calls are made (unless the configuration
+// asks for a trace file) and el_cleanup() leaves the memory alone. The
+// buffer must outlive all use of the allocator. Returns 0 on success and
+// -1 if the configuration is invalid or the buffer is too small to hold
+// a block.
+int el_init_with_buffer(void *buf, size_t size) {
+    if (el_init_conf() != 0) {
+        return -1;
+    }
+    // start block headers on a word boundary
+    size_t skip = -(size_t) buf % sizeof(size_t);
+    if (size < skip) {
+        skip = size;
+    }
+    el_ctl.heap_owned = 0;
+    el_ctl.parent = NULL;
+    el_sig_init();
+    // the caller's memory may be resident so none of it counts as purged
+    return el_init_heap(&el_ctl, PTR_PLUS_BYTES(buf, skip), size - skip);
+}
+
+// Create a sub-heap of size bytes inside a single block allocated from
+// parent, which may be &el_ctl or another sub-heap. The sub-heap is an
+// independent allocator with its own lists and lock used through the
+// el_heap_*() functions; it starts with the fit, split_min and cold
+// hint of parent and does no tracing. Creating and destroying a sub-heap
+// makes no system calls. Returns the sub-heap or NULL if parent has no
+// room for it.
+el_ctl_t *el_subheap_create(el_ctl_t *parent, size_t size) {
+    // the lock word must be aligned for atomics and futex(2), and blocks
+    // of the sub-heap start aligned as those of el_ctl do
+    el_ctl_t *sub = el_heap_malloc_aligned(parent, EL_ALIGN_UP(sizeof(el_ctl_t)) + size, EL_ALIGN);
+    if (sub == NULL) {
+        return NULL;
+    }
+    sub->fit = parent->fit;
+    sub->split_min = parent->split_min;
+    sub->trace = NULL;
+    sub->cache_max = 0;
+    sub->grow = 0;
+    sub->budget = 0;
+    sub->waiters = NULL;
+    sub->waiters_tail = NULL;
+    sub->mergeable = 0;
+    sub->cold = 0;
+    sub->cold_advice = parent->cold_advice;
+    sub->epoch = 0;
+    sub->cold_blocks = 0;
+    sub->cold_pages = 0;
+    el_lock_init(&sub->lock);
+    sub->heap_owned = 0;
+    sub->parent = parent;
+    if (el_init_heap(sub, PTR_PLUS_BYTES(sub, EL_ALIGN_UP(sizeof(el_ctl_t))), size) != 0) {
+        el_heap_free(parent, sub);
+        return NULL;
+    }
+    return sub;
+}
+
+// Destroy a sub-heap made by el_subheap_create(), returning its whole
+// block to the parent with one free. Pointers allocated from the
+// sub-heap, including any sub-heaps nested in it, become invalid.
+void el_subheap_destroy(el_ctl_t *sub) {
+    el_cold_forget(sub);
+    el_ksm_forget(sub);
+    el_heap_free(sub->parent, sub);
+}
+
+// Set allocator options from a configuration string of comma separated
+// option:value pairs. Recognized options are
+//
+//   fit:first|best   policy used to pick an available block (EL_FIT_FIRST)
+//   split_min:N      remainders smaller than N bytes are not split off of
+//                    an allocated block (0)
+//   trace:PATH       record every malloc/free to PATH for replay with
+//                    el_autotune; in place growth is recorded as 'r'
+//                    and el_commit() shrinking as 'c'
+//   cache:N          keep freed blocks of up to N bytes (at most
+//                    EL_CACHE_MAX_BYTES) in lock-free size-class
+//                    stacks for reuse without the lock (0, disabled)
+//   grow:on|off      let the heap grow past EL_HEAP_INITIAL_SIZE when an
+//                    allocation does not fit and through el_grow() (off)
+//   budget:N         fail allocations that would bring the bytes in the
+//                    used list above N; see el_malloc_wait() (0, none)
+//   cold:cold|pageout  hint given to aged blocks of heaps marked with
+//                    el_heap_mark_cold(): MADV_COLD lets reclaim take
+//                    them first, MADV_PAGEOUT reclaims them at once (cold)
+//
+// Options before an invalid one are applied; returns 0 on success and
+// -1 if any option is not valid.
+int el_set_conf(const char *conf) {
+    char *copy = strdup(conf);
+    char *save = NULL;
+    int ret = 0;
+    for (char *opt = strtok_r(copy, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(opt, ':');
+        if (val == NULL) {
+            fprintf(stderr,"el_set_conf: option '%s' has no value\n", opt);
+            ret = -1;
+            break;
+        }
+        *val++ = '\0';
+        if (strcmp(opt, "fit") == 0 && strcmp(val, "first") == 0) {
+            el_ctl.fit = EL_FIT_FIRST;
+        } else if (strcmp(opt, "fit") == 0 && strcmp(val, "best") == 0) {
+            el_ctl.fit = EL_FIT_BEST;
+        } else if (strcmp(opt, "split_min") == 0) {
+            el_ctl.split_min = strtoul(val, NULL, 10);
+        } else if (strcmp(opt, "grow") == 0 && strcmp(val, "on") == 0) {
+            el_ctl.grow = 1;
+        } else if (strcmp(opt, "grow") == 0 && strcmp(val, "off") == 0) {
+            el_ctl.grow = 0;
+        } else if (strcmp(opt, "cold") == 0 && strcmp(val, "cold") == 0) {
+            el_ctl.cold_advice = MADV_COLD;
+        } else if (strcmp(opt, "cold") == 0 && strcmp(val, "pageout") == 0) {
+            el_ctl.cold_advice = MADV_PAGEOUT;
+        } else if (strcmp(opt, "budget") == 0) {
+            el_ctl.budget = strtoul(val, NULL, 10);
+        } else if (strcmp(opt, "cache") == 0) {
+            size_t max = strtoul(val, NULL, 10);
+            el_ctl.cache_max = max < EL_CACHE_MAX_BYTES ? max : EL_CACHE_MAX_BYTES - 1;
+        } else if (strcmp(opt, "trace") == 0) {
+            if (el_ctl.trace != NULL) {
+                fclose(el_ctl.trace);
+            }
+            el_ctl.trace = fopen(val, "w");
+            if (el_ctl.trace == NULL) {
+                perror("el_set_conf: trace");
+                ret = -1;
+                break;
+            }
+        } else {
+            fprintf(stderr,"el_set_conf: unknown option '%s:%s'\n", opt, val);
+            ret = -1;
+            break;
+        }
+    }
+    free(copy);
+    return ret;
+}
+
 // Clean up the heap area associated with the system
 void el_cleanup() {
-    munmap(el_ctl.heap_start, el_ctl.heap_bytes);
+    el_grow_stop();
+    el_cold_stop();
+    el_cold_forget_all();
+    el_cache_flush();
+    if (el_ctl.trace != NULL) {
+        fclose(el_ctl.trace);
+        el_ctl.trace = NULL;
+    }
+    if (el_ctl.heap_owned) {
+        munmap(el_ctl.heap_start, el_ctl.heap_bytes);
+    }
     el_ctl.heap_start = NULL;
     el_ctl.heap_end = NULL;
 }
@@ -83,8 +373,13 @@ el_blockhead_t *el_get_header(el_blockfoot_t *foot){
 // footer. Returns NULL if the block above would be off the heap.
 // DOES NOT follow next pointer, looks in adjacent memory.
 el_blockhead_t *el_block_above(el_blockhead_t *block) {
+    return el_heap_block_above(&el_ctl, block);
+}
+
+// el_block_above() for a block of the given heap
+el_blockhead_t *el_heap_block_above(el_ctl_t *heap, el_blockhead_t *block) {
     el_blockhead_t *higher = PTR_PLUS_BYTES(block, block->size + EL_BLOCK_OVERHEAD);
-    if ((void *) higher >= (void*) el_ctl.heap_end) {
+    if ((void *) higher >= (void*) heap->heap_end) {
         return NULL;
     } else {
         return higher;
@@ -100,9 +395,14 @@ el_blockhead_t *el_block_above(el_blockhead_t *block) {
 // WARNING: This function must perform slightly different arithmetic
 // than el_block_above(). Take care when implementing it.
 el_blockhead_t *el_block_below(el_blockhead_t *block){
+  return el_heap_block_below(&el_ctl, block);
+}
+
+// el_block_below() for a block of the given heap
+el_blockhead_t *el_heap_block_below(el_ctl_t *heap, el_blockhead_t *block){
   el_blockfoot_t *prev_foot = PTR_MINUS_BYTES(block, sizeof(el_blockfoot_t));
   // checks if the block is outside heap
-  if((void *) prev_foot < (void*) el_ctl.heap_start) {
+  if((void *) prev_foot < (void*) heap->heap_start) {
     return NULL;
   } else {
     // if the block is in heap get the head and return
@@ -169,6 +469,328 @@ void el_print_stats() {
     el_print_blocklist(el_ctl.used);
 }
 
+// Event hooks
+
+// Install the hooks in hooks, replacing any set before, or remove all
+// hooks if hooks is NULL. Hooks are read without locking so set them
+// while no other thread allocates. The free hook runs only for blocks
+// that were in use; invalid and double frees are not reported. It runs
+// with the heap lock held when called from el_free_batch() so must not
+// free or allocate from that heap. Returns 0 on success and -1 if hooks
+// were compiled out with EL_NO_HOOKS.
+int el_set_hooks(const el_hooks_t *hooks) {
+#ifdef EL_NO_HOOKS
+    return hooks == NULL ? 0 : -1;
+#else
+    el_hooks_t none = {};
+    el_hooks = hooks != NULL ? *hooks : none;
+    return 0;
+#endif
+}
+
+// Per-thread counters
+
+// Return a pointer to the calling thread's count of usable bytes it has
+// allocated (including growth by el_expand()/el_realloc()). The count
+// only increases so the bytes allocated by a piece of work are the
+// difference of two plain loads through this pointer. The pointer stays
+// valid for the life of the thread.
+size_t *el_thread_allocatedp() {
+    return &el_thread_allocated;
+}
+
+// Return a pointer to the calling thread's count of usable bytes it has
+// freed; as for el_thread_allocatedp(). Blocks freed by a thread other
+// than the one that allocated them count against the freeing thread.
+size_t *el_thread_deallocatedp() {
+    return &el_thread_deallocated;
+}
+
+// Allocation scopes
+
+// Begin an allocation scope for the calling thread. Until the scope ends
+// every block the thread allocates from el_ctl is recorded in a log so
+// el_txn_abort() can release them all at once, e.g. when a request fails
+// after building part of its objects. Blocks freed inside the scope are
+// dropped from the log and blocks moved by el_realloc() are logged at
+// their new address. Scopes do not nest; returns 0 on success and -1 if
+// a scope is already open.
+int el_txn_begin() {
+    if (el_txn.active) {
+        return -1;
+    }
+    el_txn.active = 1;
+    el_txn.len = 0;
+    return 0;
+}
+
+// End the current allocation scope keeping its blocks. Costs O(1) as the
+// log is simply forgotten.
+void el_txn_commit() {
+    el_txn.active = 0;
+    el_txn.len = 0;
+}
+
+// End the current allocation scope freeing every block allocated in it
+// and not yet freed, with one el_free_batch() call.
+void el_txn_abort() {
+    el_txn.active = 0;          // so the frees below skip the log
+    el_free_batch(el_txn.ptrs, el_txn.len);
+    el_txn.len = 0;
+}
+
+// Record ptr in the scope log. Returns 0 on success and -1 if the log
+// cannot grow.
+static int el_txn_log(void *ptr) {
+    if (el_txn.len == el_txn.cap) {
+        size_t cap = el_txn.cap > 0 ? 2 * el_txn.cap : 64;
+        void **ptrs = realloc(el_txn.ptrs, cap * sizeof(void *));
+        if (ptrs == NULL) {
+            return -1;
+        }
+        el_txn.ptrs = ptrs;
+        el_txn.cap = cap;
+    }
+    el_txn.ptrs[el_txn.len++] = ptr;
+    return 0;
+}
+
+// Drop ptr from the scope log if present. Searches from the most recent
+// entry as objects freed inside a scope are usually young.
+static void el_txn_unlog(void *ptr) {
+    for (size_t i = el_txn.len; i > 0; i--) {
+        if (el_txn.ptrs[i - 1] == ptr) {
+            el_txn.ptrs[i - 1] = el_txn.ptrs[--el_txn.len];
+            return;
+        }
+    }
+}
+
+// Locking
+
+// Initialize lock to be unlocked with zeroed counters
+void el_lock_init(el_lock_t *lock) {
+    lock->state = 0;
+    lock->acquisitions = 0;
+    lock->contended = 0;
+    lock->sleeps = 0;
+    lock->wait_ns = 0;
+}
+
+static long el_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void el_cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Acquire lock. The uncontended case is a single compare and swap. A
+// contended waiter spins EL_LOCK_SPINS times then marks the lock as
+// having sleepers (state 2) and waits on the futex until it can take it.
+void el_lock(el_lock_t *lock) {
+    int c = 0;
+    if (__atomic_compare_exchange_n(&lock->state, &c, 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        lock->acquisitions++;
+        return;
+    }
+    long start = el_now_ns();
+    size_t sleeps = 0;
+    for (int i = 0; i < EL_LOCK_SPINS; i++) {
+        el_cpu_relax();
+        c = 0;
+        if (__atomic_load_n(&lock->state, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&lock->state, &c, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            goto acquired;
+        }
+    }
+    while (__atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE) != 0) {
+        syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+        sleeps++;
+    }
+  acquired:
+    lock->acquisitions++;
+    lock->contended++;
+    lock->sleeps += sleeps;
+    lock->wait_ns += el_now_ns() - start;
+}
+
+// Release lock waking one sleeper if there may be any
+void el_unlock(el_lock_t *lock) {
+    if (__atomic_fetch_sub(&lock->state, 1, __ATOMIC_RELEASE) != 1) {
+        __atomic_store_n(&lock->state, 0, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+// Print the lock counters of the heap in the following format.
+//
+// LOCK STATS
+// acquisitions: 1000000  contended: 5231  sleeps: 112  wait_ns: 8123400
+void el_print_lock_stats() {
+    el_lock_t *lock = &el_ctl.lock;
+    printf("LOCK STATS\n");
+    printf("acquisitions: %lu  contended: %lu  sleeps: %lu  wait_ns: %lu\n",
+           lock->acquisitions, lock->contended, lock->sleeps, lock->wait_ns);
+}
+
+// Page accounting
+
+// Return the bounds of the whole pages of heap in lo and hi
+static void el_heap_page_range(el_ctl_t *heap, size_t *lo, size_t *hi) {
+    *lo = ((size_t) heap->heap_start + EL_PAGE_SIZE - 1) / EL_PAGE_SIZE * EL_PAGE_SIZE;
+    *hi = (size_t) heap->heap_end / EL_PAGE_SIZE * EL_PAGE_SIZE;
+    *hi = *hi > *lo ? *hi : *lo;
+}
+
+// Return the number of whole pages lying between the header and footer
+// of the given block. Only these pages can be purged as the pages holding
+// the header and footer must stay resident.
+size_t el_block_pages(el_blockhead_t *block) {
+    size_t lo = (size_t) PTR_PLUS_BYTES(block, sizeof(el_blockhead_t));
+    size_t hi = (size_t) el_get_footer(block);
+    lo = (lo + EL_PAGE_SIZE - 1) / EL_PAGE_SIZE * EL_PAGE_SIZE;
+    hi = hi / EL_PAGE_SIZE * EL_PAGE_SIZE;
+    return hi > lo ? (hi - lo) / EL_PAGE_SIZE : 0;
+}
+
+// Return the whole pages inside every available block that are not yet
+// purged to the OS with madvise(MADV_DONTNEED). The pages read back as
+// zeros when next touched. Returns the number of pages purged.
+size_t el_purge() {
+    return el_heap_purge(&el_ctl);
+}
+
+// el_purge() for the given heap
+size_t el_heap_purge(el_ctl_t *heap) {
+    el_lock(&heap->lock);
+    size_t purged = 0;
+    el_blockhead_t *block = heap->avail->beg->next;
+    for (; block != heap->avail->end; block = block->next) {
+        size_t pages = el_block_pages(block);
+        if (block->purged == pages) {
+            continue;
+        }
+        size_t lo = (size_t) PTR_PLUS_BYTES(block, sizeof(el_blockhead_t));
+        lo = (lo + EL_PAGE_SIZE - 1) / EL_PAGE_SIZE * EL_PAGE_SIZE;
+        size_t dirty = pages - block->purged;
+        if (madvise((void *) lo, dirty * EL_PAGE_SIZE, MADV_DONTNEED) != 0) {
+            continue;
+        }
+        block->purged = pages;
+        heap->purged_pages += dirty;
+        purged += dirty;
+    }
+    el_unlock(&heap->lock);
+    return purged;
+}
+
+// Fill stats with the page accounting kept incrementally by the
+// malloc/free/purge paths. This costs no system calls. Only whole pages
+// of the heap are counted, so a sub-heap leaves out the partial pages at
+// its ends.
+void el_get_page_stats(el_page_stats_t *stats) {
+    el_heap_get_page_stats(&el_ctl, stats);
+}
+
+// el_get_page_stats() for the given heap
+void el_heap_get_page_stats(el_ctl_t *heap, el_page_stats_t *stats) {
+    size_t lo, hi;
+    el_lock(&heap->lock);
+    el_heap_page_range(heap, &lo, &hi);
+    stats->pages = (hi - lo) / EL_PAGE_SIZE;
+    stats->purged = heap->purged_pages;
+    stats->dirty = heap->avail->pages - heap->purged_pages;
+    stats->live = stats->pages - heap->avail->pages;
+    el_unlock(&heap->lock);
+}
+
+// Fill stats with page accounting measured with mincore(): dirty and
+// purged are the resident and non-resident pages inside available
+// blocks and live counts the resident pages outside of them. Useful to
+// check the incremental counts against actual RSS. Returns 0 on success
+// and -1 if mincore() fails.
+int el_audit_pages(el_page_stats_t *stats) {
+    return el_heap_audit_pages(&el_ctl, stats);
+}
+
+// el_audit_pages() for the given heap, over the same whole pages as
+// el_heap_get_page_stats()
+int el_heap_audit_pages(el_ctl_t *heap, el_page_stats_t *stats) {
+    size_t heap_lo, heap_hi;
+    el_lock(&heap->lock);
+    el_heap_page_range(heap, &heap_lo, &heap_hi);
+    size_t npages = (heap_hi - heap_lo) / EL_PAGE_SIZE;
+    unsigned char *vec = malloc(npages + 1);
+    unsigned char *inside = calloc(npages + 1, 1);
+    if (vec == NULL || inside == NULL ||
+        mincore((void *) heap_lo, heap_hi - heap_lo, vec) != 0) {
+        el_unlock(&heap->lock);
+        free(vec);
+        free(inside);
+        return -1;
+    }
+    el_blockhead_t *block = heap->avail->beg->next;
+    for (; block != heap->avail->end; block = block->next) {
+        size_t lo = (size_t) PTR_PLUS_BYTES(block, sizeof(el_blockhead_t));
+        lo = (lo + EL_PAGE_SIZE - 1) / EL_PAGE_SIZE * EL_PAGE_SIZE;
+        size_t first = (lo - heap_lo) / EL_PAGE_SIZE;
+        size_t pages = el_block_pages(block);
+        for (size_t i = first; i < first + pages; i++) {
+            inside[i] = 1;
+        }
+    }
+    el_unlock(&heap->lock);
+    stats->pages = npages;
+    stats->live = stats->dirty = stats->purged = 0;
+    for (size_t i = 0; i < npages; i++) {
+        int resident = vec[i] & 1;
+        if (!inside[i]) {
+            stats->live += resident;
+        } else if (resident) {
+            stats->dirty++;
+        } else {
+            stats->purged++;
+        }
+    }
+    free(vec);
+    free(inside);
+    return 0;
+}
+
+// Print the incremental page accounting and, if mincore() succeeds, the
+// audited counts next to it in the following format.
+//
+// PAGE STATS (page size: 4096)
+//            pages     live    dirty   purged
+// counted:    1024      310      402      312
+// audited:    1024      305      398      321
+void el_print_page_stats() {
+    el_heap_print_page_stats(&el_ctl);
+}
+
+// el_print_page_stats() for the given heap
+void el_heap_print_page_stats(el_ctl_t *heap) {
+    el_page_stats_t counted, audited;
+    el_heap_get_page_stats(heap, &counted);
+    printf("PAGE STATS (page size: %lu)\n", EL_PAGE_SIZE);
+    printf("%9s %8s %8s %8s %8s\n", "", "pages", "live", "dirty", "purged");
+    printf("counted: %8lu %8lu %8lu %8lu\n",
+           counted.pages, counted.live, counted.dirty, counted.purged);
+    if (el_heap_audit_pages(heap, &audited) == 0) {
+        printf("audited: %8lu %8lu %8lu %8lu\n",
+               audited.pages, audited.live, audited.dirty, audited.purged);
+    }
+}
+
 // Initialize the specified list to be empty. Sets the beg/end
 // pointers to the actual space and initializes those data to be the
 // ends of the list. Initializes length and size to 0.
@@ -185,6 +807,7 @@ void el_init_blocklist(el_blocklist_t *list) {
     list->end->prev = list->beg;
     list->length = 0;
     list->bytes = 0;
+    list->pages = 0;
 }
 
 // Add to the front of list; links for block are adjusted as are links
@@ -199,6 +822,7 @@ void el_add_block_front(el_blocklist_t *list, el_blockhead_t *block){
   // Updating size parameters of list
   list->length += 1;
   list->bytes += (EL_BLOCK_OVERHEAD + block->size);
+  list->pages += el_block_pages(block);
   return;
 }
 
@@ -212,6 +836,7 @@ void el_remove_block(el_blocklist_t *list, el_blockhead_t *block){
   // Update parameters
   list->length -= 1;
   list->bytes -= (EL_BLOCK_OVERHEAD + block->size);
+  list->pages -= el_block_pages(block);
   return;
 }
 
@@ -223,8 +848,13 @@ void el_remove_block(el_blocklist_t *list, el_blockhead_t *block){
 // requires adding in a new header/footer. Returns a pointer to the
 // found block or NULL if no of sufficient size is available.
 el_blockhead_t *el_find_first_avail(size_t size){
+  return el_heap_find_first_avail(&el_ctl, size);
+}
+
+// el_find_first_avail() in the given heap
+el_blockhead_t *el_heap_find_first_avail(el_ctl_t *heap, size_t size){
   // Pointing to available list
-  el_blocklist_t *avail = el_ctl.avail;
+  el_blocklist_t *avail = heap->avail;
   size_t total_avail = avail->length;
   el_blockhead_t *start = avail->beg->next;
   // Searching for the list with appropriate size
@@ -238,6 +868,42 @@ el_blockhead_t *el_find_first_avail(size_t size){
   return NULL;
 }
 
+// Find the smallest block in the available list with block size of at
+// least (size + EL_BLOCK_OVERHEAD). Stops early on a block of exactly
+// that size. Returns NULL if no block of sufficient size is available.
+el_blockhead_t *el_find_best_avail(size_t size){
+  return el_heap_find_best_avail(&el_ctl, size);
+}
+
+// el_find_best_avail() in the given heap
+el_blockhead_t *el_heap_find_best_avail(el_ctl_t *heap, size_t size){
+  el_blockhead_t *best = NULL;
+  el_blockhead_t *block = heap->avail->beg->next;
+  for(; block != heap->avail->end; block = block->next) {
+    if(block->size >= size+EL_BLOCK_OVERHEAD && (best == NULL || block->size < best->size)) {
+      best = block;
+      if(best->size == size+EL_BLOCK_OVERHEAD) {
+        break;
+      }
+    }
+  }
+  return best;
+}
+
+// Find an available block for an allocation of the given size using the
+// fit policy set in el_ctl.fit.
+el_blockhead_t *el_find_avail(size_t size){
+  return el_heap_find_avail(&el_ctl, size);
+}
+
+// el_find_avail() in the given heap using its fit policy
+el_blockhead_t *el_heap_find_avail(el_ctl_t *heap, size_t size){
+  if(heap->fit == EL_FIT_BEST) {
+    return el_heap_find_best_avail(heap, size);
+  }
+  return el_heap_find_first_avail(heap, size);
+}
+
 // Set the pointed to block to the given size and add a footer to it. Creates
 // another block above it by creating a new header and assigning it the
 // remaining space. Ensures that the new block has a footer with the correct
@@ -269,29 +935,375 @@ el_blockhead_t *el_split_block(el_blockhead_t *block, size_t new_size){
   }
 }
 
+// Split the part of block beyond its first nbytes off into a new
+// available block which is added to the front of the available list of
+// heap. Does nothing if the remainder would be smaller than
+// heap->split_min or there is no room for its header/footer. top_purged
+// is the number of non-resident pages at the top of block which the new
+// block inherits as it shares that top. block must not be linked into a
+// list while its size changes. Returns the new block or NULL if no split
+// was made.
+el_blockhead_t *el_split_tail(el_ctl_t *heap, el_blockhead_t *block, size_t nbytes, size_t top_purged){
+  if(block->size < nbytes + EL_BLOCK_OVERHEAD ||
+     block->size - nbytes - EL_BLOCK_OVERHEAD < heap->split_min) {
+    return NULL;
+  }
+  el_blockhead_t *tail = el_split_block(block, nbytes);
+  el_add_block_front(heap->avail, tail);
+  tail->state = EL_AVAILABLE;
+  size_t pages = el_block_pages(tail);
+  tail->purged = top_purged < pages ? top_purged : pages;
+  heap->purged_pages += tail->purged;
+  return tail;
+}
+
 // Return pointer to a block of memory with at least the given size
 // for use by the user. The pointer returned is to the usable space,
-// not the block header. Makes use of find_first_avail() to find a
-// suitable block and el_split_block() to split it. Returns NULL if
-// no space is available.
+// not the block header. Makes use of el_find_avail() to find a
+// suitable block and el_split_block() to split it unless the remainder
+// would be smaller than el_ctl.split_min. Returns NULL if no space is
+// available.
 void *el_malloc(size_t nbytes){
-  // pointer to the first available block of at least nbytes size
-  el_blockhead_t *first = el_find_first_avail(nbytes);
+  return el_heap_malloc(&el_ctl, nbytes);
+}
+
+// el_heap_malloc_nolock() which, for el_ctl, tries again after flushing
+// the size-class cache and after growing the heap
+static void *el_heap_malloc_retry(el_ctl_t *heap, size_t nbytes){
+  void *ptr = el_heap_malloc_nolock(heap, nbytes);
+  // cached blocks may coalesce into a large enough one
+  if(ptr == NULL && heap == &el_ctl && el_cache_flush_nolock() > 0) {
+    ptr = el_heap_malloc_nolock(heap, nbytes);
+  }
+  if(ptr == NULL && heap == &el_ctl && el_ctl.grow && el_grow_nolock(nbytes) == 0) {
+    ptr = el_heap_malloc_nolock(heap, nbytes);
+  }
+  return ptr;
+}
+
+// el_malloc() from the given heap
+void *el_heap_malloc(el_ctl_t *heap, size_t nbytes){
+  void *ptr = NULL;
+  if(heap == &el_ctl && el_ctl.cache_max > 0 && nbytes <= el_ctl.cache_max) {
+    ptr = el_cache_pop(nbytes);
+  }
+  if(ptr == NULL) {
+    el_lock(&heap->lock);
+    ptr = el_heap_malloc_retry(heap, nbytes);
+    el_unlock(&heap->lock);
+  }
+  if(ptr != NULL) {
+    EL_HOOK(malloc, ptr, nbytes);
+  }
+  return ptr;
+}
+
+// el_heap_malloc() for callers holding heap->lock
+void *el_heap_malloc_nolock(el_ctl_t *heap, size_t nbytes){
+  if(heap->budget > 0 && heap->used->bytes + EL_BLOCK_OVERHEAD + nbytes > heap->budget) {
+    return NULL;
+  }
+  // pointer to an available block of at least nbytes size
+  el_blockhead_t *first = el_heap_find_avail(heap, nbytes);
   if(first == NULL) {
     return NULL;
   }
-  // Split block
-  // First is now of size nbytes, second is now the other half
-  el_remove_block(el_ctl.avail, first);
-  el_blockhead_t *second = el_split_block(first, nbytes);
+  el_remove_block(heap->avail, first);
+  heap->purged_pages -= first->purged;
+  // First is now of size nbytes, the remainder goes back as available
+  el_split_tail(heap, first, nbytes, first->purged);
+  first->purged = 0;
   // link them
-  el_add_block_front(el_ctl.used,first);
+  el_add_block_front(heap->used,first);
   first->state = EL_USED;
-  el_add_block_front(el_ctl.avail,second);
-  second->state = EL_AVAILABLE;
+  first->cold = 0;
+  first->epoch = heap->epoch;
+  el_thread_allocated += first->size;
   // Update pointer to point to memory, and not to the header
-  first = PTR_PLUS_BYTES(first, sizeof(el_blockhead_t));
-  return first;
+  void *ptr = PTR_PLUS_BYTES(first, sizeof(el_blockhead_t));
+  if(heap->trace != NULL) {
+    fprintf(heap->trace, "m %p %lu\n", ptr, nbytes);
+  }
+  // an allocation that cannot be logged in an open scope fails
+  if(heap == &el_ctl && el_txn.active && el_txn_log(ptr) != 0) {
+    el_heap_free_nolock(heap, ptr);
+    return NULL;
+  }
+  return ptr;
+}
+
+// Allocate nbytes at an address that is a multiple of align, a power of
+// two, such as EL_ALIGN for structures holding atomics or futex words.
+// A block is taken with room for a whole block in front of the aligned
+// payload; that front part goes back to the available list, as does
+// anything past nbytes, so nothing is wasted beyond split_min. The block
+// is freed with el_free() like any other. Returns NULL if no space is
+// available.
+void *el_malloc_aligned(size_t nbytes, size_t align){
+  return el_heap_malloc_aligned(&el_ctl, nbytes, align);
+}
+
+// el_malloc_aligned() from the given heap
+void *el_heap_malloc_aligned(el_ctl_t *heap, size_t nbytes, size_t align){
+  el_lock(&heap->lock);
+  // the trace records the aligned block rather than the one found
+  FILE *trace = heap->trace;
+  heap->trace = NULL;
+  void *ptr = el_heap_malloc_retry(heap, nbytes + align - 1 + EL_BLOCK_OVERHEAD);
+  heap->trace = trace;
+  if(ptr == NULL) {
+    el_unlock(&heap->lock);
+    return NULL;
+  }
+  void *aligned = ptr;
+  if((size_t) ptr % align != 0) {
+    // split off the front, which is at least a block overhead long
+    aligned = (void *) (((size_t) ptr + EL_BLOCK_OVERHEAD + align - 1) / align * align);
+    el_blockhead_t *front = PTR_MINUS_BYTES(ptr, sizeof(el_blockhead_t));
+    el_blockhead_t *block = PTR_MINUS_BYTES(aligned, sizeof(el_blockhead_t));
+    size_t total = front->size;
+    el_remove_block(heap->used, front);
+    front->size = PTR_MINUS_PTR(aligned, ptr) - EL_BLOCK_OVERHEAD;
+    el_get_footer(front)->size = front->size;
+    block->size = total - PTR_MINUS_PTR(aligned, ptr);
+    el_get_footer(block)->size = block->size;
+    block->state = EL_USED;
+    block->cold = 0;
+    block->epoch = heap->epoch;
+    block->purged = 0;
+    el_add_block_front(heap->used, block);
+    el_thread_allocated -= total - block->size;
+    front->state = EL_AVAILABLE;
+    front->purged = 0;
+    el_add_block_front(heap->avail, front);
+    el_blockhead_t *below = el_heap_block_below(heap, front);
+    if(below != NULL) {
+      el_heap_merge_block_with_above(heap, below);
+    }
+    if(heap == &el_ctl && el_txn.active) {
+      for(size_t i = 0; i < el_txn.len; i++) {
+        el_txn.ptrs[i] = el_txn.ptrs[i] == ptr ? aligned : el_txn.ptrs[i];
+      }
+    }
+  }
+  // give back the tail past nbytes
+  el_blockhead_t *block = PTR_MINUS_BYTES(aligned, sizeof(el_blockhead_t));
+  heap->used->bytes -= EL_BLOCK_OVERHEAD + block->size;
+  heap->used->pages -= el_block_pages(block);
+  size_t old_size = block->size;
+  el_blockhead_t *tail = el_split_tail(heap, block, nbytes, 0);
+  heap->used->bytes += EL_BLOCK_OVERHEAD + block->size;
+  heap->used->pages += el_block_pages(block);
+  if(tail != NULL) {
+    el_thread_allocated -= old_size - block->size;
+    el_heap_merge_block_with_above(heap, tail);
+  }
+  if(heap->trace != NULL) {
+    fprintf(heap->trace, "m %p %lu\n", aligned, nbytes);
+  }
+  el_unlock(&heap->lock);
+  EL_HOOK(malloc, aligned, nbytes);
+  return aligned;
+}
+
+// Return the number of bytes usable at ptr, a pointer returned by
+// el_malloc(). This may be more than was requested when a remainder was
+// too small to split off or after el_expand().
+size_t el_usable_size(void *ptr){
+  el_blockhead_t *block = PTR_MINUS_BYTES(ptr, sizeof(el_blockhead_t));
+  return block->size;
+}
+
+// Try to grow the block at ptr in place to at least nbytes by absorbing
+// the available block immediately above it in memory. Any part of the
+// absorbed block beyond nbytes is split off again as available. The
+// block keeps its place in the used list. Returns 0 on success and -1 if
+// the block above is not available or too small, leaving ptr unchanged.
+int el_expand(void *ptr, size_t nbytes){
+  return el_heap_expand(&el_ctl, ptr, nbytes);
+}
+
+// el_expand() for a block of the given heap
+int el_heap_expand(el_ctl_t *heap, void *ptr, size_t nbytes){
+  el_lock(&heap->lock);
+  int ret = el_heap_expand_nolock(heap, ptr, nbytes);
+  el_unlock(&heap->lock);
+  if(ret == 0) {
+    EL_HOOK(realloc, ptr, ptr, nbytes);
+  }
+  return ret;
+}
+
+// el_heap_expand() for callers holding heap->lock
+int el_heap_expand_nolock(el_ctl_t *heap, void *ptr, size_t nbytes){
+  el_blockhead_t *block = PTR_MINUS_BYTES(ptr, sizeof(el_blockhead_t));
+  if(block->size >= nbytes) {
+    return 0;
+  }
+  el_blockhead_t *above = el_heap_block_above(heap, block);
+  if(above == NULL || above->state != EL_AVAILABLE ||
+     block->size + EL_BLOCK_OVERHEAD + above->size < nbytes) {
+    return -1;
+  }
+  if(heap->budget > 0 && heap->used->bytes + (nbytes - block->size) > heap->budget) {
+    return -1;
+  }
+  el_remove_block(heap->avail, above);
+  heap->purged_pages -= above->purged;
+  // take block out of the used list totals while its size changes
+  heap->used->bytes -= EL_BLOCK_OVERHEAD + block->size;
+  heap->used->pages -= el_block_pages(block);
+  size_t old_size = block->size;
+  block->size += EL_BLOCK_OVERHEAD + above->size;
+  el_get_footer(block)->size = block->size;
+  el_split_tail(heap, block, nbytes, above->purged);
+  el_thread_allocated += block->size - old_size;
+  block->cold = 0;
+  block->epoch = heap->epoch;
+  heap->used->bytes += EL_BLOCK_OVERHEAD + block->size;
+  heap->used->pages += el_block_pages(block);
+  if(heap->trace != NULL) {
+    fprintf(heap->trace, "r %p %lu\n", ptr, nbytes);
+  }
+  return 0;
+}
+
+// Resize the block at ptr to hold at least nbytes, returning a pointer to
+// the resized memory. Grows in place with el_expand() when possible and
+// otherwise allocates a new block, copies the contents over and frees the
+// old one. A NULL ptr behaves as el_malloc(). Shrinking keeps the block as
+// it is. Blocks from el_malloc_rc() are only grown in place as other
+// references would be left pointing at the old block. Returns NULL and
+// leaves ptr allocated if no space is available or the block may not move.
+void *el_realloc(void *ptr, size_t nbytes){
+  return el_heap_realloc(&el_ctl, ptr, nbytes);
+}
+
+// el_realloc() for a block of the given heap
+void *el_heap_realloc(el_ctl_t *heap, void *ptr, size_t nbytes){
+  if(ptr == NULL) {
+    return el_heap_malloc(heap, nbytes);
+  }
+  el_lock(&heap->lock);
+  void *moved = ptr;
+  el_blockhead_t *block = PTR_MINUS_BYTES(ptr, sizeof(el_blockhead_t));
+  if(el_heap_expand_nolock(heap, ptr, nbytes) != 0) {
+    // the count in the header makes a block counted
+    moved = block->refs == 0 ? el_heap_malloc_nolock(heap, nbytes) : NULL;
+    if(moved != NULL) {
+      memcpy(moved, ptr, el_usable_size(ptr));
+      el_heap_free_nolock(heap, ptr);
+    }
+  }
+  el_unlock(&heap->lock);
+  if(moved != NULL) {
+    EL_HOOK(realloc, ptr, moved, nbytes);
+  }
+  return moved;
+}
+
+// Wake the thread blocked in el_malloc_wait() on waiter; caller holds
+// the heap lock which keeps waiter valid
+static void el_waiter_wake(el_waiter_t *waiter){
+  __atomic_store_n(&waiter->woken, 1, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &waiter->woken, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// Allocate a buffer of max bytes for data whose final size is not yet
+// known, e.g. a network read. Once the size is known el_commit() gives
+// the unused tail back without copying. The same as el_malloc().
+void *el_reserve(size_t max){
+  return el_malloc(max);
+}
+
+// Shrink the block at ptr in place to the first used bytes. The rest is
+// split off as an available block which merges with the block above if
+// that is available, so no data moves. The tail stays with the block if
+// it would be smaller than split_min. Returns the usable size afterwards.
+size_t el_commit(void *ptr, size_t used){
+  return el_heap_commit(&el_ctl, ptr, used);
+}
+
+// el_commit() for a block of the given heap
+size_t el_heap_commit(el_ctl_t *heap, void *ptr, size_t used){
+  el_blockhead_t *block = PTR_MINUS_BYTES(ptr, sizeof(el_blockhead_t));
+  el_lock(&heap->lock);
+  // take block out of the used list totals while its size changes
+  heap->used->bytes -= EL_BLOCK_OVERHEAD + block->size;
+  heap->used->pages -= el_block_pages(block);
+  size_t old_size = block->size;
+  el_blockhead_t *tail = el_split_tail(heap, block, used, 0);
+  heap->used->bytes += EL_BLOCK_OVERHEAD + block->size;
+  heap->used->pages += el_block_pages(block);
+  if(tail != NULL) {
+    el_thread_deallocated += old_size - block->size;
+    el_heap_merge_block_with_above(heap, tail);
+    if(heap->trace != NULL) {
+      fprintf(heap->trace, "c %p %lu\n", ptr, used);
+    }
+    if(heap->waiters != NULL) {
+      el_waiter_wake(heap->waiters);
+    }
+  }
+  size_t size = block->size;
+  el_unlock(&heap->lock);
+  EL_HOOK(realloc, ptr, ptr, used);
+  return size;
+}
+
+// Allocate nbytes like el_malloc() for a buffer shared by reference
+// counting. The count lives in the block header, in the word that holds
+// purged pages while the block is available, so no separate control
+// block is needed. The block is aligned to EL_ALIGN which keeps the
+// count aligned for atomic updates. The count starts at 1. Release with
+// el_release(), never el_free(); el_realloc() only grows the block in
+// place.
+void *el_malloc_rc(size_t nbytes){
+  return el_heap_malloc_rc(&el_ctl, nbytes);
+}
+
+// el_malloc_rc() from the given heap
+void *el_heap_malloc_rc(el_ctl_t *heap, size_t nbytes){
+  void *ptr = el_heap_malloc_aligned(heap, nbytes, EL_ALIGN);
+  if(ptr != NULL) {
+    el_blockhead_t *block = PTR_MINUS_BYTES(ptr, sizeof(el_blockhead_t));
+    __atomic_store_n(&block->refs, 1, __ATOMIC_RELAXED);
+  }
+  return ptr;
+}
+
+// Take another reference to ptr from el_malloc_rc(). Safe to call from
+// any thread holding a reference without locking. Returns ptr.
+void *el_retain(void *ptr){
+  el_blockhead_t *block = PTR_MINUS_BYTES(ptr, sizeof(el_blockhead_t));
+  __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+  return ptr;
+}
+
+// Drop a reference to ptr from el_malloc_rc(), freeing the block when
+// the last one goes. Returns the references left, 0 if the block was
+// freed. Releasing a block that holds no references, as one not from
+// el_malloc_rc() or already freed, is ignored and returns 0.
+unsigned int el_release(void *ptr){
+  return el_heap_release(&el_ctl, ptr);
+}
+
+// el_release() for a block of the given heap
+unsigned int el_heap_release(el_ctl_t *heap, void *ptr){
+  el_blockhead_t *block = PTR_MINUS_BYTES(ptr, sizeof(el_blockhead_t));
+  unsigned int refs = __atomic_load_n(&block->refs, __ATOMIC_RELAXED);
+  do {
+    if(block->state != EL_USED || refs == 0) {
+      return 0;
+    }
+    // release so writes made through this reference happen before the free
+  } while(!__atomic_compare_exchange_n(&block->refs, &refs, refs - 1, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+  unsigned int left = refs - 1;
+  if(left == 0) {
+    el_heap_free(heap, ptr);
+  }
+  return left;
 }
 
 // De-allocation/free() related functions
@@ -306,7 +1318,12 @@ void *el_malloc(size_t nbytes){
 // indicate the two blocks are merged. Removes both lower and higher from the
 // available list and re-adds lower to the front of the available list.
 void el_merge_block_with_above(el_blockhead_t *lower){
-  el_blockhead_t *above = el_block_above(lower);
+  el_heap_merge_block_with_above(&el_ctl, lower);
+}
+
+// el_merge_block_with_above() for a block of the given heap
+void el_heap_merge_block_with_above(el_ctl_t *heap, el_blockhead_t *lower){
+  el_blockhead_t *above = el_heap_block_above(heap, lower);
   if(lower == NULL || lower->state != EL_AVAILABLE || above == NULL || above->state != EL_AVAILABLE) {
     return;
   } else {
@@ -316,14 +1333,17 @@ void el_merge_block_with_above(el_blockhead_t *lower){
     size_t total = size_lower + size_above;
     // assigning the footer of the second above block
     el_blockfoot_t *above_foot = el_get_footer(above);
-    // remove both from the available
-    el_remove_block(el_ctl.avail, above);
-    el_remove_block(el_ctl.avail, lower);
+    // remove both from the available; the merged block has the top of
+    // above so keeps its purged pages while those of lower become dirty
+    el_remove_block(heap->avail, above);
+    el_remove_block(heap->avail, lower);
+    heap->purged_pages -= lower->purged;
+    lower->purged = above->purged;
     // Update size
     lower->size = total + EL_BLOCK_OVERHEAD;
     above_foot->size = total + EL_BLOCK_OVERHEAD;
     // Add new block with the updated size in to the front of the list.
-    el_add_block_front(el_ctl.avail, lower);
+    el_add_block_front(heap->avail, lower);
     return;
   }
 }
@@ -333,21 +1353,848 @@ void el_merge_block_with_above(el_blockhead_t *lower){
 // on the block size. Attempts to merge the free'd block with adjacent
 // blocks using el_merge_block_with_above().
 void el_free(void *ptr){
-  el_blockhead_t *header_to_free = PTR_MINUS_BYTES(ptr, sizeof(el_blockhead_t));
-  if(header_to_free->state == EL_AVAILABLE) {
+  el_heap_free(&el_ctl, ptr);
+}
+
+// el_free() for a block of the given heap
+void el_heap_free(el_ctl_t *heap, void *ptr){
+  // blocked allocations are waiting for used bytes to drop which caching
+  // the block would not do
+  if(heap == &el_ctl && el_ctl.cache_max > 0 && el_ctl.waiters == NULL &&
+     el_cache_push(ptr) == 0) {
     return;
   }
-  el_blockhead_t *before = el_block_below(header_to_free);
+  el_lock(&heap->lock);
+  int freed = el_heap_free_nolock(heap, ptr) == 0;
+  el_unlock(&heap->lock);
+  // like the trace, hooks only see blocks that were in use
+  if(freed) {
+    EL_HOOK(free, ptr);
+  }
+}
+
+// Move the used block header_to_free of heap to the available list and
+// coalesce it with its neighbours. Shared by el_heap_free_nolock() and
+// the cache consolidator which frees blocks that were already counted
+// and traced when they entered the cache.
+static void el_release_block(el_ctl_t *heap, el_blockhead_t *header_to_free){
+  el_blockhead_t *before = el_heap_block_below(heap, header_to_free);
   // Remove block from used list, set state to avail, 
   // add it to the avail list
-  el_remove_block(el_ctl.used, header_to_free);
+  el_remove_block(heap->used, header_to_free);
   header_to_free->state = EL_AVAILABLE;
-  el_add_block_front(el_ctl.avail,header_to_free);
+  header_to_free->purged = 0;
+  el_add_block_front(heap->avail,header_to_free);
   // Attempts to merge with above and the below block.
-  el_merge_block_with_above(header_to_free);
+  el_heap_merge_block_with_above(heap, header_to_free);
   // Checks if before is out of bounds
   if (before != NULL) {
-    el_merge_block_with_above(before);
+    el_heap_merge_block_with_above(heap, before);
+  }
+  // the first blocked allocation may fit now
+  if (heap->waiters != NULL && !heap->waiters->woken) {
+    el_waiter_wake(heap->waiters);
   }
   return;
 }
+
+// el_heap_free() for callers holding heap->lock. The free hook is left
+// to the caller. Returns 0 if the block was freed and -1 if it was not in
+// use, as for an invalid or double free, which is ignored.
+int el_heap_free_nolock(el_ctl_t *heap, void *ptr){
+  el_blockhead_t *header_to_free = PTR_MINUS_BYTES(ptr, sizeof(el_blockhead_t));
+  // invalid and double frees are ignored and must not reach the trace
+  if(header_to_free->state != EL_USED) {
+    return -1;
+  }
+  if(heap == &el_ctl && el_txn.active) {
+    el_txn_unlog(ptr);
+  }
+  if(heap->trace != NULL) {
+    fprintf(heap->trace, "f %p\n", ptr);
+  }
+  el_thread_deallocated += header_to_free->size;
+  el_release_block(heap, header_to_free);
+  return 0;
+}
+
+// Free each of the n pointers in ptrs with el_free(), skipping NULLs.
+// Lets callers that release many blocks at once (e.g. el_iobuf chains)
+// hand them to the allocator taking the lock only once. The free hook
+// runs for each block freed while the lock is held.
+void el_free_batch(void **ptrs, size_t n){
+  el_heap_free_batch(&el_ctl, ptrs, n);
+}
+
+// el_free_batch() for blocks of the given heap
+void el_heap_free_batch(el_ctl_t *heap, void **ptrs, size_t n){
+  el_lock(&heap->lock);
+  for(size_t i = 0; i < n; i++) {
+    if(ptrs[i] != NULL && el_heap_free_nolock(heap, ptrs[i]) == 0) {
+      EL_HOOK(free, ptrs[i]);
+    }
+  }
+  el_unlock(&heap->lock);
+}
+
+// Size-class cache
+
+// Load the head of a cache stack. The two halves are read separately so
+// may be torn, in which case the following compare-and-swap fails.
+static el_cache_head_t el_cache_load(el_cache_head_t *head) {
+    el_cache_head_t old;
+    old.tag = __atomic_load_n(&head->tag, __ATOMIC_ACQUIRE);
+    old.top = __atomic_load_n(&head->top, __ATOMIC_ACQUIRE);
+    return old;
+}
+
+// Replace the head of a cache stack with new if it still holds old.
+// Returns 1 if it did and 0 if another thread changed it first.
+static int el_cache_swap(el_cache_head_t *head, el_cache_head_t old, el_cache_head_t new) {
+#ifdef EL_CACHE_CAS16
+    return __sync_bool_compare_and_swap(&head->word, old.word, new.word);
+#else
+    el_lock(&el_cache_lock);
+    int same = head->top == old.top && head->tag == old.tag;
+    if (same) {
+        __atomic_store_n(&head->top, new.top, __ATOMIC_RELEASE);
+        __atomic_store_n(&head->tag, new.tag, __ATOMIC_RELEASE);
+    }
+    el_unlock(&el_cache_lock);
+    return same;
+#endif
+}
+
+// Push block, already marked cached, onto the stack head
+static void el_cache_stack_push(el_cache_head_t *head, el_blockhead_t *block) {
+    el_cache_head_t old, new;
+    do {
+        old = el_cache_load(head);
+        el_cache_set_link(block, old.top);
+        new.top = block;
+        new.tag = old.tag + 1;
+    } while (!el_cache_swap(head, old, new));
+}
+
+// Pop a cached block of at least nbytes from its size class without
+// taking the lock. Blocks in the stack stay used as far as the lists are
+// concerned so nothing else touches them and the link read from a block
+// another thread popped meanwhile is harmless: the tag makes the swap
+// fail. Returns NULL if the class is empty.
+void *el_cache_pop(size_t nbytes) {
+    size_t class = (nbytes + EL_CACHE_QUANTUM - 1) / EL_CACHE_QUANTUM;
+    class = class > 0 ? class : 1;
+    el_cache_head_t *head = &el_cache[class];
+    el_cache_head_t old, new;
+    do {
+        old = el_cache_load(head);
+        if (old.top == NULL) {
+            return NULL;
+        }
+        new.top = el_cache_link(old.top);
+        new.tag = old.tag + 1;
+    } while (!el_cache_swap(head, old, new));
+
+    el_blockhead_t *block = old.top;
+    void *ptr = PTR_PLUS_BYTES(block, sizeof(el_blockhead_t));
+    if (el_txn.active && el_txn_log(ptr) != 0) {
+        // still marked cached so it goes straight back on its stack
+        el_cache_stack_push(head, block);
+        return NULL;
+    }
+    block->state = EL_USED;
+    block->cold = 0;
+    block->epoch = el_ctl.epoch;
+    el_thread_allocated += block->size;
+    if (el_ctl.trace != NULL) {
+        fprintf(el_ctl.trace, "m %p %lu\n", ptr, nbytes);
+    }
+    return ptr;
+}
+
+// Push the block at ptr onto the stack of its size class without taking
+// the lock. Returns 0 if the block was cached and -1 if it is too small,
+// too large or not in use, leaving it to el_free().
+int el_cache_push(void *ptr) {
+    el_blockhead_t *block = PTR_MINUS_BYTES(ptr, sizeof(el_blockhead_t));
+    if (block->size < EL_CACHE_QUANTUM || block->size > el_ctl.cache_max ||
+        block->state != EL_USED) {
+        return -1;
+    }
+    if (el_txn.active) {
+        el_txn_unlog(ptr);
+    }
+    if (el_ctl.trace != NULL) {
+        fprintf(el_ctl.trace, "f %p\n", ptr);
+    }
+    EL_HOOK(free, ptr);
+    el_thread_deallocated += block->size;
+    block->state = EL_CACHED;
+    el_cache_stack_push(&el_cache[block->size / EL_CACHE_QUANTUM], block);
+    return 0;
+}
+
+// Consolidate the cache: detach every stack and release its blocks to
+// the available list where they coalesce with their neighbours. Run when
+// an allocation finds no available block and by el_cleanup(). Returns
+// the number of blocks released.
+size_t el_cache_flush() {
+    el_lock(&el_ctl.lock);
+    size_t n = el_cache_flush_nolock();
+    el_unlock(&el_ctl.lock);
+    return n;
+}
+
+// el_cache_flush() for callers holding el_ctl.lock
+size_t el_cache_flush_nolock() {
+    size_t n = 0;
+    for (size_t class = 1; class < EL_CACHE_CLASSES; class++) {
+        el_cache_head_t *head = &el_cache[class];
+        el_cache_head_t old, new;
+        do {
+            old = el_cache_load(head);
+            new.top = NULL;
+            new.tag = old.tag + 1;
+        } while (old.top != NULL && !el_cache_swap(head, old, new));
+        for (el_blockhead_t *block = old.top; block != NULL; n++) {
+            el_blockhead_t *next = el_cache_link(block);
+            el_release_block(&el_ctl, block);
+            block = next;
+        }
+    }
+    return n;
+}
+
+// Heap growth
+
+// State of the growth controller run by el_grow_tick()
+static struct {
+    long last_ns;               // time of the previous sample; 0 before the first
+    size_t last_used;           // bytes in the used list at that sample
+    double rate;                // smoothed growth of used bytes per second
+    pthread_t thread;           // background thread started by el_grow_start()
+    volatile int running;
+} el_grower = {};
+
+// Round bytes up to whole pages and to at least EL_GROW_MIN_BYTES
+static size_t el_grow_bytes(size_t bytes) {
+    bytes = (bytes + EL_PAGE_SIZE - 1) / EL_PAGE_SIZE * EL_PAGE_SIZE;
+    return bytes > EL_GROW_MIN_BYTES ? bytes : EL_GROW_MIN_BYTES;
+}
+
+// Map bytes at end, which must be the current end of the heap. With
+// prefault the pages are populated by the kernel straight away. Returns
+// -1 if that address range is not free.
+static int el_grow_map(void *end, size_t bytes, int prefault) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE;
+    void *mem = mmap(end, bytes, PROT_READ | PROT_WRITE, flags | (prefault ? MAP_POPULATE : 0), -1, 0);
+    if (mem != end) {
+        if (mem != MAP_FAILED) {
+            munmap(mem, bytes);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Add the bytes just mapped at the end of the heap as an available block
+// and merge it with the block below; caller holds el_ctl.lock
+static void el_grow_link(size_t bytes, int prefault) {
+    el_blockhead_t *block = el_ctl.heap_end;
+    if (el_ctl.mergeable) {
+        madvise(block, bytes, MADV_MERGEABLE);
+    }
+    el_ctl.heap_bytes += bytes;
+    el_ctl.heap_end = PTR_PLUS_BYTES(el_ctl.heap_end, bytes);
+    block->size = bytes - EL_BLOCK_OVERHEAD;
+    block->state = EL_AVAILABLE;
+    el_get_footer(block)->size = block->size;
+    el_add_block_front(el_ctl.avail, block);
+    block->purged = prefault ? 0 : el_block_pages(block);
+    el_ctl.purged_pages += block->purged;
+    el_blockhead_t *below = el_heap_block_below(&el_ctl, block);
+    if (below != NULL) {
+        el_heap_merge_block_with_above(&el_ctl, below);
+    }
+}
+
+// Grow the heap of el_ctl in place by at least bytes, mapping the new
+// pages right after its end. With prefault the pages are faulted in
+// before they are added so later allocations do not pay for it. The
+// lock is not held while mapping so allocations carry on meanwhile.
+// Returns 0 on success and -1 if growth is off, the heap was supplied by
+// the caller or the address range above the heap is taken.
+int el_grow(size_t bytes, int prefault) {
+    if (!el_ctl.grow || !el_ctl.heap_owned) {
+        return -1;
+    }
+    bytes = el_grow_bytes(bytes);
+    el_lock(&el_ctl.lock);
+    void *end = el_ctl.heap_end;
+    el_unlock(&el_ctl.lock);
+    // only one of several racing growers can map at end and only the
+    // grower that mapped it moves heap_end
+    if (el_grow_map(end, bytes, prefault) != 0) {
+        return -1;
+    }
+    el_lock(&el_ctl.lock);
+    el_grow_link(bytes, prefault);
+    el_unlock(&el_ctl.lock);
+    return 0;
+}
+
+// Grow the heap enough for an allocation of nbytes that did not fit;
+// caller holds el_ctl.lock. Returns 0 on success and -1 otherwise.
+int el_grow_nolock(size_t nbytes) {
+    if (!el_ctl.grow || !el_ctl.heap_owned) {
+        return -1;
+    }
+    size_t bytes = el_grow_bytes(nbytes + 2 * EL_BLOCK_OVERHEAD);
+    if (el_grow_map(el_ctl.heap_end, bytes, 0) != 0) {
+        return -1;
+    }
+    el_grow_link(bytes, 0);
+    return 0;
+}
+
+// Take one sample for the growth controller. The rate at which used
+// bytes grow is smoothed over samples; when the available bytes would not
+// cover that rate for EL_GROW_HORIZON_NS the heap grows, prefaulted, by
+// the shortfall. Meant to be called every EL_GROW_INTERVAL_NS, usually by
+// the thread of el_grow_start(). Returns the number of bytes grown.
+size_t el_grow_tick() {
+    long now = el_now_ns();
+    el_lock(&el_ctl.lock);
+    size_t used = el_ctl.used->bytes;
+    size_t avail = el_ctl.avail->bytes;
+    el_unlock(&el_ctl.lock);
+    if (el_grower.last_ns == 0 || now <= el_grower.last_ns) {
+        el_grower.last_ns = now;
+        el_grower.last_used = used;
+        return 0;
+    }
+    double rate = ((double) used - (double) el_grower.last_used) * 1e9 / (now - el_grower.last_ns);
+    el_grower.rate = 0.25 * rate + 0.75 * el_grower.rate;
+    el_grower.last_ns = now;
+    el_grower.last_used = used;
+
+    double need = el_grower.rate * EL_GROW_HORIZON_NS * 1e-9;
+    if (need <= avail) {
+        return 0;
+    }
+    size_t bytes = el_grow_bytes(need - avail);
+    return el_grow(bytes, 1) == 0 ? bytes : 0;
+}
+
+static void *el_grow_main(void *arg) {
+    struct timespec interval = {0, EL_GROW_INTERVAL_NS};
+    while (el_grower.running) {
+        el_grow_tick();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+// Start a background thread running el_grow_tick() every
+// EL_GROW_INTERVAL_NS so heap growth and page faults happen off the
+// allocating threads. Returns 0 on success and -1 if growth is off or the
+// thread cannot be started.
+int el_grow_start() {
+    if (!el_ctl.grow || el_grower.running) {
+        return -1;
+    }
+    el_grower.last_ns = 0;
+    el_grower.rate = 0;
+    el_grower.running = 1;
+    if (pthread_create(&el_grower.thread, NULL, el_grow_main, NULL) != 0) {
+        el_grower.running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Stop the thread of el_grow_start() if running
+void el_grow_stop() {
+    if (el_grower.running) {
+        el_grower.running = 0;
+        pthread_join(el_grower.thread, NULL);
+    }
+}
+
+// Blocking allocation
+
+// Allocate nbytes like el_malloc() but if that fails, because the budget
+// is used up or the heap is full, wait for frees to make room instead of
+// returning NULL. Waiters are served in arrival order: each free wakes
+// only the first waiter and a new call does not overtake waiting ones.
+// Gives up after timeout_ns nanoseconds, or never if timeout_ns is
+// negative, and returns NULL.
+void *el_malloc_wait(size_t nbytes, long timeout_ns){
+  long deadline = el_now_ns() + timeout_ns;
+  el_waiter_t self = {NULL, 0};
+  el_lock(&el_ctl.lock);
+  void *ptr = NULL;
+  if(el_ctl.waiters == NULL) {
+    ptr = el_heap_malloc_retry(&el_ctl, nbytes);
+  }
+  if(ptr != NULL) {
+    el_unlock(&el_ctl.lock);
+    EL_HOOK(malloc, ptr, nbytes);
+    return ptr;
+  }
+
+  if(el_ctl.waiters_tail != NULL) {
+    el_ctl.waiters_tail->next = &self;
+  } else {
+    el_ctl.waiters = &self;
+  }
+  el_ctl.waiters_tail = &self;
+  while(1) {
+    if(el_ctl.waiters == &self) {
+      ptr = el_heap_malloc_retry(&el_ctl, nbytes);
+      if(ptr != NULL) {
+        break;
+      }
+    }
+    long left = deadline - el_now_ns();
+    if(timeout_ns >= 0 && left <= 0) {
+      break;
+    }
+    struct timespec ts = {left / 1000000000L, left % 1000000000L};
+    self.woken = 0;
+    el_unlock(&el_ctl.lock);
+    syscall(SYS_futex, &self.woken, FUTEX_WAIT_PRIVATE, 0, timeout_ns >= 0 ? &ts : NULL, NULL, 0);
+    el_lock(&el_ctl.lock);
+  }
+
+  // leave the queue and let the next waiter try, room may be left over
+  el_waiter_t **link = &el_ctl.waiters;
+  el_waiter_t *prev = NULL;
+  while(*link != &self) {
+    prev = *link;
+    link = &(*link)->next;
+  }
+  *link = self.next;
+  if(el_ctl.waiters_tail == &self) {
+    el_ctl.waiters_tail = prev;
+  }
+  if(el_ctl.waiters != NULL) {
+    el_waiter_wake(el_ctl.waiters);
+  }
+  el_unlock(&el_ctl.lock);
+  if(ptr != NULL) {
+    EL_HOOK(malloc, ptr, nbytes);
+  }
+  return ptr;
+}
+
+// Signal-safe pool
+
+// Slots of the pool and the bitmap of those allocated, bit i of word
+// i / 64 for slot i. Kept in static storage so the pool exists before
+// any handler can run and never depends on the heap or its lock.
+static char el_sig_mem[EL_SIG_SLOTS * EL_SIG_SLOT_BYTES] __attribute__((aligned(16)));
+static unsigned long el_sig_map[(EL_SIG_SLOTS + 63) / 64];
+static el_sig_stats_t el_sig_stats = {};
+
+// Reset the pool to all slots free and touch its pages so handlers do
+// not fault them in. Run by el_init() and el_init_with_buffer().
+static void el_sig_init() {
+    memset(el_sig_mem, 0, sizeof(el_sig_mem));
+    memset(el_sig_map, 0, sizeof(el_sig_map));
+    el_sig_stats.slots = EL_SIG_SLOTS;
+    el_sig_stats.slot_bytes = EL_SIG_SLOT_BYTES;
+    el_sig_stats.used = 0;
+    el_sig_stats.peak = 0;
+    el_sig_stats.allocs = 0;
+    el_sig_stats.fails = 0;
+}
+
+// Allocate nbytes, at most EL_SIG_SLOT_BYTES, from the signal-safe pool.
+// Safe to call from a signal handler, including one interrupting
+// el_malloc() or el_sig_malloc() itself: only atomic operations on the
+// bitmap are used, with no lock, system call or heap list involved. It
+// is wait-free as each slot is tried at most once, so a call finishes in
+// at most EL_SIG_SLOTS atomic operations whatever other threads do.
+// Returns NULL if nbytes is too large or every slot is taken.
+void *el_sig_malloc(size_t nbytes) {
+    if (nbytes <= EL_SIG_SLOT_BYTES) {
+        for (size_t w = 0; w < sizeof(el_sig_map) / sizeof(el_sig_map[0]); w++) {
+            unsigned long tried = 0;
+            unsigned long valid = w * 64 + 64 <= EL_SIG_SLOTS ? ~0UL : (1UL << (EL_SIG_SLOTS % 64)) - 1;
+            while (1) {
+                unsigned long open = ~__atomic_load_n(&el_sig_map[w], __ATOMIC_RELAXED) & ~tried & valid;
+                if (open == 0) {
+                    break;
+                }
+                unsigned long bit = open & -open;
+                tried |= bit;
+                if ((__atomic_fetch_or(&el_sig_map[w], bit, __ATOMIC_ACQUIRE) & bit) == 0) {
+                    size_t slot = w * 64 + __builtin_ctzl(bit);
+                    size_t used = __atomic_add_fetch(&el_sig_stats.used, 1, __ATOMIC_RELAXED);
+                    size_t peak = __atomic_load_n(&el_sig_stats.peak, __ATOMIC_RELAXED);
+                    while (used > peak &&
+                           !__atomic_compare_exchange_n(&el_sig_stats.peak, &peak, used, 0,
+                                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                        // peak only rises, at most EL_SIG_SLOTS times
+                    }
+                    __atomic_add_fetch(&el_sig_stats.allocs, 1, __ATOMIC_RELAXED);
+                    return el_sig_mem + slot * EL_SIG_SLOT_BYTES;
+                }
+            }
+        }
+    }
+    __atomic_add_fetch(&el_sig_stats.fails, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// Return ptr from el_sig_malloc() to the pool. As safe as
+// el_sig_malloc() and a single atomic operation; NULL and pointers from
+// elsewhere are ignored.
+void el_sig_free(void *ptr) {
+    char *p = ptr;
+    if (p < el_sig_mem || p >= el_sig_mem + sizeof(el_sig_mem)) {
+        return;
+    }
+    size_t slot = (p - el_sig_mem) / EL_SIG_SLOT_BYTES;
+    unsigned long bit = 1UL << (slot % 64);
+    if (__atomic_fetch_and(&el_sig_map[slot / 64], ~bit, __ATOMIC_RELEASE) & bit) {
+        __atomic_sub_fetch(&el_sig_stats.used, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Copy the statistics of the signal-safe pool into stats
+void el_sig_get_stats(el_sig_stats_t *stats) {
+    stats->slots = el_sig_stats.slots;
+    stats->slot_bytes = el_sig_stats.slot_bytes;
+    stats->used = __atomic_load_n(&el_sig_stats.used, __ATOMIC_RELAXED);
+    stats->peak = __atomic_load_n(&el_sig_stats.peak, __ATOMIC_RELAXED);
+    stats->allocs = __atomic_load_n(&el_sig_stats.allocs, __ATOMIC_RELAXED);
+    stats->fails = __atomic_load_n(&el_sig_stats.fails, __ATOMIC_RELAXED);
+}
+
+// Print the statistics of the signal-safe pool in the following format.
+// Uses printf() so do not call from a signal handler.
+//
+// SIGNAL POOL STATS
+// slots:  128 x 256 bytes
+// used:     3  peak:    40
+// allocs:  52  fails:    1
+void el_print_sig_stats() {
+    el_sig_stats_t stats;
+    el_sig_get_stats(&stats);
+    printf("SIGNAL POOL STATS\n");
+    printf("slots:  %3lu x %lu bytes\n", stats.slots, stats.slot_bytes);
+    printf("used:   %3lu  peak:  %4lu\n", stats.used, stats.peak);
+    printf("allocs: %3lu  fails: %4lu\n", stats.allocs, stats.fails);
+}
+
+// Page merging
+
+// 1 once any heap was offered to KSM
+static int el_ksm_offered = 0;
+
+// Offer the pages of heap to KSM with madvise(MADV_MERGEABLE) so the
+// kernel may merge pages holding identical data, such as the same
+// reference data loaded by many processes, into one copy-on-write page.
+// Meant for a dedicated heap of read-mostly data: merged pages are
+// copied again on the next write to them. Pages the heap grows by later
+// are offered too. Only whole pages are offered, so for a sub-heap the
+// partial pages at its ends are left out. Returns 0 on success and -1
+// if the kernel does not support KSM.
+int el_heap_set_mergeable(el_ctl_t *heap) {
+    el_lock(&heap->lock);
+    size_t lo, hi;
+    el_heap_page_range(heap, &lo, &hi);
+    int ret = 0;
+    if (hi > lo && madvise((void *) lo, hi - lo, MADV_MERGEABLE) != 0) {
+        ret = -1;
+    }
+    heap->mergeable = ret == 0;
+    el_ksm_offered |= heap->mergeable;
+    el_unlock(&heap->lock);
+    return ret;
+}
+
+// Withdraw the pages of a sub-heap being destroyed from KSM so the
+// parent does not keep offering them. Sub-heaps nested in it may have
+// been offered without it so the range is withdrawn whenever any heap
+// was offered, unless an enclosing heap still wants it offered.
+static void el_ksm_forget(el_ctl_t *sub) {
+    if (!el_ksm_offered) {
+        return;
+    }
+    for (el_ctl_t *heap = sub->parent; heap != NULL; heap = heap->parent) {
+        if (heap->mergeable) {
+            return;
+        }
+    }
+    size_t lo, hi;
+    el_heap_page_range(sub, &lo, &hi);
+    if (hi > lo) {
+        madvise((void *) lo, hi - lo, MADV_UNMERGEABLE);
+    }
+    sub->mergeable = 0;
+}
+
+// Read the process-wide counts of /proc/self/ksm_stat into stats,
+// leaving -1 for any the kernel does not report
+static void el_read_ksm_stat(el_ksm_stats_t *stats) {
+    stats->process_merging = -1;
+    stats->process_profit = -1;
+    FILE *f = fopen("/proc/self/ksm_stat", "r");
+    if (f == NULL) {
+        return;
+    }
+    char name[64];
+    long value;
+    while (fscanf(f, "%63s %ld", name, &value) == 2) {
+        if (strcmp(name, "ksm_merging_pages") == 0) {
+            stats->process_merging = value;
+        } else if (strcmp(name, "ksm_process_profit") == 0) {
+            stats->process_profit = value;
+        }
+    }
+    fclose(f);
+}
+
+// Fill stats with the page sharing of heap, which need not be
+// mergeable. Per-page state is read from /proc/self/pagemap: bit 63 is
+// set for a present page and bit 56 when it is mapped exclusively.
+// Returns 0 on success and -1 if the page map cannot be read.
+int el_heap_get_ksm_stats(el_ctl_t *heap, el_ksm_stats_t *stats) {
+    el_read_ksm_stat(stats);
+    size_t lo, hi;
+    el_heap_page_range(heap, &lo, &hi);
+    size_t npages = (hi - lo) / EL_PAGE_SIZE;
+    stats->pages = heap->mergeable ? npages : 0;
+    stats->resident = stats->shared = stats->unshared = 0;
+    if (npages == 0) {
+        return 0;
+    }
+    unsigned long *entries = malloc(npages * sizeof(unsigned long));
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+    size_t want = npages * sizeof(unsigned long);
+    if (entries == NULL || fd < 0 ||
+        pread(fd, entries, want, lo / EL_PAGE_SIZE * sizeof(unsigned long)) != (ssize_t) want) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(entries);
+        return -1;
+    }
+    close(fd);
+    for (size_t i = 0; i < npages; i++) {
+        if (entries[i] >> 63 & 1) {
+            stats->resident++;
+            if (entries[i] >> 56 & 1) {
+                stats->unshared++;
+            } else {
+                stats->shared++;
+            }
+        }
+    }
+    free(entries);
+    return 0;
+}
+
+// Print the page sharing of heap in the following format; process
+// counts the kernel does not report are shown as -1.
+//
+// KSM STATS (mergeable: 1)
+// pages: 16384  resident: 12800  shared: 9120  unshared: 3680
+// process merging pages: 9120  profit: 37027840
+void el_heap_print_ksm_stats(el_ctl_t *heap) {
+    el_ksm_stats_t stats;
+    int ret = el_heap_get_ksm_stats(heap, &stats);
+    printf("KSM STATS (mergeable: %d)\n", heap->mergeable);
+    if (ret == 0) {
+        printf("pages: %lu  resident: %lu  shared: %lu  unshared: %lu\n",
+               stats.pages, stats.resident, stats.shared, stats.unshared);
+    }
+    printf("process merging pages: %ld  profit: %ld\n",
+           stats.process_merging, stats.process_profit);
+}
+
+// Cold-data hinting
+
+// Heaps marked with el_heap_mark_cold() and the thread of
+// el_cold_start() ticking them
+static struct {
+    el_ctl_t *heaps[EL_COLD_MAX_HEAPS];
+    int nheaps;
+    el_lock_t lock;             // guards heaps; taken before any heap lock
+    pthread_t thread;
+    volatile int running;
+} el_cold = {};
+
+// Mark heap, typically a sub-heap dedicated to a subsystem whose memory
+// is rarely touched, as holding cold data. From then on each
+// el_heap_cold_tick() on it ages its used blocks and gives the whole
+// pages of those not allocated or resized for EL_COLD_AGE ticks to
+// madvise() with heap->cold_advice, MADV_COLD unless the configuration
+// says otherwise, so reclaim takes them before hot pages. The age is
+// allocation age: reads and writes are not seen, so a block in use is
+// only as cold as its allocation is old. Hints are therefore re-armed,
+// a block is hinted again every EL_COLD_AGE ticks until it is resized
+// or freed, which returns pages touched since the last hint to the cold
+// end of reclaim. Data is kept: a hinted page that is touched again
+// simply faults back in. Returns 0 on success and -1 if
+// EL_COLD_MAX_HEAPS heaps are already marked.
+int el_heap_mark_cold(el_ctl_t *heap) {
+    el_lock(&el_cold.lock);
+    int ret = 0;
+    if (!heap->cold && el_cold.nheaps == EL_COLD_MAX_HEAPS) {
+        ret = -1;
+    } else if (!heap->cold) {
+        el_cold.heaps[el_cold.nheaps++] = heap;
+        heap->cold = 1;
+    }
+    el_unlock(&el_cold.lock);
+    return ret;
+}
+
+// Remove heap from the marked heaps before it goes away, along with the
+// sub-heaps nested in it whose control blocks lie in its memory
+static void el_cold_forget(el_ctl_t *heap) {
+    el_lock(&el_cold.lock);
+    for (int i = 0; i < el_cold.nheaps; ) {
+        el_ctl_t *marked = el_cold.heaps[i];
+        if (marked == heap ||
+            ((void *) marked >= heap->heap_start && (void *) marked < heap->heap_end)) {
+            marked->cold = 0;
+            el_cold.heaps[i] = el_cold.heaps[--el_cold.nheaps];
+        } else {
+            i++;
+        }
+    }
+    heap->cold = 0;
+    el_unlock(&el_cold.lock);
+}
+
+// Forget every marked heap; all of them live in the heap el_cleanup()
+// is releasing
+static void el_cold_forget_all() {
+    el_lock(&el_cold.lock);
+    el_cold.nheaps = 0;
+    el_unlock(&el_cold.lock);
+}
+
+// Advance the epoch of heap, if it is marked cold, and hint the pages of
+// each used block that has reached EL_COLD_AGE epochs without being
+// allocated, resized or hinted. Blocks without a whole page of their own
+// are passed over. Returns the pages hinted.
+size_t el_heap_cold_tick(el_ctl_t *heap) {
+    el_lock(&heap->lock);
+    if (!heap->cold) {
+        el_unlock(&heap->lock);
+        return 0;
+    }
+    heap->epoch++;
+    size_t hinted = 0;
+    el_blockhead_t *block = heap->used->beg->next;
+    for (; block != heap->used->end; block = block->next) {
+        unsigned short age = heap->epoch - block->epoch;
+        if (age < EL_COLD_AGE) {
+            continue;
+        }
+        size_t pages = el_block_pages(block);
+        size_t lo = (size_t) PTR_PLUS_BYTES(block, sizeof(el_blockhead_t));
+        lo = (lo + EL_PAGE_SIZE - 1) / EL_PAGE_SIZE * EL_PAGE_SIZE;
+        if (pages > 0 && madvise((void *) lo, pages * EL_PAGE_SIZE, heap->cold_advice) != 0) {
+            continue;
+        }
+        // age again from now so the hint is renewed after EL_COLD_AGE ticks
+        block->epoch = heap->epoch;
+        if (pages > 0) {
+            heap->cold_blocks += !block->cold;
+            heap->cold_pages += pages;
+            hinted += pages;
+        }
+        block->cold = 1;
+    }
+    el_unlock(&heap->lock);
+    return hinted;
+}
+
+// Run el_heap_cold_tick() on every marked heap. Returns the pages hinted.
+size_t el_cold_tick() {
+    size_t hinted = 0;
+    el_lock(&el_cold.lock);
+    for (int i = 0; i < el_cold.nheaps; i++) {
+        hinted += el_heap_cold_tick(el_cold.heaps[i]);
+    }
+    el_unlock(&el_cold.lock);
+    return hinted;
+}
+
+static void *el_cold_main(void *arg) {
+    // sleep in short slices so el_cold_stop() does not wait long
+    struct timespec slice = {0, EL_GROW_INTERVAL_NS};
+    long slept = 0;
+    while (el_cold.running) {
+        nanosleep(&slice, NULL);
+        slept += EL_GROW_INTERVAL_NS;
+        if (slept >= EL_COLD_INTERVAL_NS) {
+            el_cold_tick();
+            slept = 0;
+        }
+    }
+    return NULL;
+}
+
+// Start a background thread running el_cold_tick() every
+// EL_COLD_INTERVAL_NS, which makes blocks of marked heaps cold after
+// about EL_COLD_AGE intervals. Returns 0 on success and -1 if it is
+// already running or the thread cannot be started.
+int el_cold_start() {
+    if (el_cold.running) {
+        return -1;
+    }
+    el_cold.running = 1;
+    if (pthread_create(&el_cold.thread, NULL, el_cold_main, NULL) != 0) {
+        el_cold.running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Stop the thread of el_cold_start() if running
+void el_cold_stop() {
+    if (el_cold.running) {
+        el_cold.running = 0;
+        pthread_join(el_cold.thread, NULL);
+    }
+}
+
+// Fill stats with the cold-data hinting of heap
+void el_heap_get_cold_stats(el_ctl_t *heap, el_cold_stats_t *stats) {
+    el_lock(&heap->lock);
+    stats->epoch = heap->epoch;
+    stats->hinted_blocks = heap->cold_blocks;
+    stats->hinted_pages = heap->cold_pages;
+    stats->cold_blocks = stats->cold_pages = 0;
+    el_blockhead_t *block = heap->used->beg->next;
+    for (; block != heap->used->end; block = block->next) {
+        size_t pages = el_block_pages(block);
+        if (block->cold && pages > 0) {
+            stats->cold_blocks++;
+            stats->cold_pages += pages;
+        }
+    }
+    el_unlock(&heap->lock);
+}
+
+// Print the cold-data hinting of heap in the following format.
+//
+// COLD STATS (marked: 1  advice: cold  epoch: 42)
+// hinted: blocks    12  pages   310
+// cold:   blocks     9  pages   250
+void el_heap_print_cold_stats(el_ctl_t *heap) {
+    el_cold_stats_t stats;
+    el_heap_get_cold_stats(heap, &stats);
+    printf("COLD STATS (marked: %d  advice: %s  epoch: %u)\n", heap->cold,
+           heap->cold_advice == MADV_PAGEOUT ? "pageout" : "cold", stats.epoch);
+    printf("hinted: blocks %5lu  pages %5lu\n", stats.hinted_blocks, stats.hinted_pages);
+    printf("cold:   blocks %5lu  pages %5lu\n", stats.cold_blocks, stats.cold_pages);
+}
@@ -1,6 +1,9 @@
 #ifndef EL_MALLOC_H
 #define EL_MALLOC_H
 
+#include <stddef.h>
+#include <stdio.h>
+
 // macro to add a byte offset to a pointer, arguments are a pointer
 // and a number of bytes (usually size_t)
 #define PTR_PLUS_BYTES(ptr, off) ((void *) (((size_t) (ptr)) + ((size_t) (off))))
@@ -13,17 +16,70 @@
 // apart in bytes
 #define PTR_MINUS_PTR(ptr,ptq) ((long) (((size_t) (ptr)) - ((size_t) (ptq))))
 
-// Basic defines for the default size/starting place of the heap
+// Basic defines for the default size/starting place of the heap. The
+// initial size may be overridden at compile time (e.g. the benchmarks
+// build el_malloc.c with -DEL_HEAP_INITIAL_SIZE=... to get a larger heap)
 #define EL_HEAP_START_ADDRESS ((void *) 0x0000600000000000)
+#ifndef EL_HEAP_INITIAL_SIZE
 #define EL_HEAP_INITIAL_SIZE  ((size_t) 4096)
+#endif
+
+// Alignment of payloads from el_malloc_aligned() with EL_ALIGN and of
+// the control blocks of sub-heaps and object caches, enough for any
+// type, atomic operations and futex words. Plain el_malloc() payloads
+// follow the requested sizes and have no alignment guarantee.
+#define EL_ALIGN        _Alignof(max_align_t)
+#define EL_ALIGN_UP(n)  (((size_t) (n) + EL_ALIGN - 1) / EL_ALIGN * EL_ALIGN)
+
+// Page size assumed by page accounting and el_purge(); madvise() ranges
+// are aligned to it
+#define EL_PAGE_SIZE ((size_t) 4096)
 
 // defines to indicate if a block is available or used
 #define EL_AVAILABLE     'a'    // block state indicating available
 #define EL_USED          'u'    // block state indicating in use
+#define EL_CACHED        'c'    // block state indicating freed into the size-class cache
 #define EL_BEGIN_BLOCK   'B'    // block state indicating dummy beginning node in a list
 #define EL_END_BLOCK     'E'    // block state indicating dummy ending node in a list
 #define EL_UNINITIALIZED  0     // indication of uninitialized data
 
+// defines for the fit policy used to pick an available block
+#define EL_FIT_FIRST     'f'    // first block in the available list that is large enough
+#define EL_FIT_BEST      'b'    // smallest block in the available list that is large enough
+
+// name of the environment variable read by el_init() for a configuration
+// string such as "fit:best,split_min:64"; see el_set_conf()
+#define EL_CONF_ENV      "EL_MALLOC_CONF"
+
+// Size classes of the lock-free cache of freed blocks (see el_cache_pop()):
+// class i holds blocks with sizes in [i*EL_CACHE_QUANTUM, (i+1)*EL_CACHE_QUANTUM)
+#define EL_CACHE_QUANTUM   ((size_t) 16)
+#define EL_CACHE_MAX_BYTES ((size_t) 4096)
+#define EL_CACHE_CLASSES   (EL_CACHE_MAX_BYTES / EL_CACHE_QUANTUM)
+
+// Heap growth (see el_grow()): the heap grows by at least
+// EL_GROW_MIN_BYTES at a time. The growth controller samples the heap
+// every EL_GROW_INTERVAL_NS and keeps enough headroom for the bytes the
+// smoothed allocation rate predicts over the next EL_GROW_HORIZON_NS.
+#define EL_GROW_MIN_BYTES   ((size_t) 64 * 1024)
+#define EL_GROW_INTERVAL_NS 10000000L
+#define EL_GROW_HORIZON_NS  100000000L
+
+// Cold-data hinting (see el_heap_mark_cold()): used blocks of a heap
+// marked cold that have not been allocated or resized for EL_COLD_AGE
+// ticks of el_heap_cold_tick() get their pages hinted to the kernel,
+// and hinted again every EL_COLD_AGE ticks after that.
+// el_cold_start() ticks every marked heap each EL_COLD_INTERVAL_NS; at
+// most EL_COLD_MAX_HEAPS heaps may be marked.
+#define EL_COLD_AGE          10
+#define EL_COLD_INTERVAL_NS  1000000000L
+#define EL_COLD_MAX_HEAPS    16
+
+// Signal-safe pool (see el_sig_malloc()): EL_SIG_SLOTS slots of
+// EL_SIG_SLOT_BYTES each, set aside apart from the heap
+#define EL_SIG_SLOT_BYTES ((size_t) 256)
+#define EL_SIG_SLOTS      128
+
 // type which is a "header" for a block of memory; contains info on
 // size, whether the block is available or in use, and links to the
 // next/prev blocks in a doubly linked list. This data structure
@@ -31,7 +87,13 @@
 // allocator.
 typedef struct block {
   size_t size;                  // number of bytes of memory in this block
-  char state;                   // either EL_AVAILABLE or EL_USED
+  char state;                   // either EL_AVAILABLE, EL_USED or EL_CACHED
+  unsigned char cold;           // for used blocks, 1 once their pages were hinted cold since allocated
+  unsigned short epoch;         // for used blocks, heap epoch when last allocated, resized or hinted
+  union {
+    unsigned int purged;        // for available blocks, number of whole pages at the top of the block not resident
+    unsigned int refs;          // for used blocks from el_malloc_rc(), references held; 0 otherwise
+  };
   struct block *next;           // pointer to next block in same list
   struct block *prev;           // pointer to previous block in same list
 } el_blockhead_t;
@@ -59,30 +121,156 @@ typedef struct {
   el_blockhead_t *end;          // pointer to end_actual
   size_t length;                // length of the used block list (not counting beg/end)
   size_t bytes;                 // total bytes in list used including overhead;
+  size_t pages;                 // whole pages lying between the header and footer of the blocks
 } el_blocklist_t;
 // NOTE: total available bytes for/in use in the list is (bytes - length*EL_BLOCK_OVERHEAD)
 
+// Lock protecting an el_ctl_t. Spins briefly with a pause hint as
+// critical sections are short then sleeps on a futex. Counters are only
+// updated by the holder of the lock and show where lock time goes.
+typedef struct {
+  int state;                    // 0 unlocked, 1 locked, 2 locked with possible sleepers
+  size_t acquisitions;          // times the lock was taken
+  size_t contended;             // acquisitions that found the lock held
+  size_t sleeps;                // times a thread slept on the futex
+  size_t wait_ns;               // total nanoseconds spent waiting for the lock
+} el_lock_t;
+
+// Number of pause iterations before a waiter sleeps on the futex
+#define EL_LOCK_SPINS 128
+
+// Functions called on allocation events by el_malloc()/el_free()/
+// el_realloc() and their el_heap_*() versions once the operation is done
+// (before it for free), outside the heap lock. Any may be NULL. arg is
+// passed through to each. Compiling el_malloc.c with -DEL_NO_HOOKS
+// removes the calls altogether.
+typedef struct {
+  void (*malloc)(void *ptr, size_t nbytes, void *arg);
+  void (*free)(void *ptr, void *arg);
+  void (*realloc)(void *old_ptr, void *new_ptr, size_t nbytes, void *arg);
+  void *arg;
+} el_hooks_t;
+
+// Thread blocked in el_malloc_wait(); waiters queue in arrival order
+typedef struct el_waiter {
+  struct el_waiter *next;
+  int woken;                    // futex word set to 1 to wake the waiter
+} el_waiter_t;
+
 // Type for the global control structure of the allocator. Tracks heap size,
 // start and end addresses, total size, and lists of available and
 // used blocks.
-typedef struct {
+typedef struct el_ctl {
   void *heap_start;             // pointer to where the heap starts
+  int heap_owned;               // 1 if the heap was mapped by el_init(), 0 if supplied by the caller
   void *heap_end;               // pointer to where the heap ends; this memory address is out of bounds
   size_t heap_bytes;            // number of bytes currently in the heap
   el_blocklist_t avail_actual;  // space for the available list data
   el_blocklist_t used_actual;   // space for the used list data
   el_blocklist_t *avail;        // pointer to avail_actual
   el_blocklist_t *used;         // pointer to used_actual
+  char fit;                     // EL_FIT_FIRST or EL_FIT_BEST
+  size_t split_min;             // smallest remainder split off a block; smaller ones stay with the allocation
+  FILE *trace;                  // if non-NULL each malloc/free is recorded here for replay
+  size_t purged_pages;          // pages inside available blocks that are purged (see el_purge())
+  el_lock_t lock;               // taken by the public malloc/free/purge functions
+  size_t cache_max;             // largest block size kept in the size-class cache; 0 disables it
+  int grow;                     // 1 if the heap may grow past its initial size
+  size_t budget;                // most bytes the used list may hold; 0 for no limit
+  el_waiter_t *waiters;         // threads in el_malloc_wait(), first to arrive first
+  el_waiter_t *waiters_tail;
+  struct el_ctl *parent;        // heap a sub-heap was carved from; NULL for el_ctl
+  int mergeable;                // 1 if the heap's pages are offered to KSM (see el_heap_set_mergeable())
+  int cold;                     // 1 if aged used blocks are hinted (see el_heap_mark_cold())
+  int cold_advice;              // MADV_COLD or MADV_PAGEOUT, the hint given to aged blocks
+  unsigned short epoch;         // ticks of el_heap_cold_tick() so far, wrapping
+  size_t cold_blocks;           // blocks hinted cold over the life of the heap, each counted once
+  size_t cold_pages;            // pages hinted cold over the life of the heap, counting renewed hints
 } el_ctl_t;
 
+// Page accounting for a heap, el_ctl or a sub-heap, over its whole
+// pages. Pages lying wholly inside an available
+// block are either dirty (resident, holding stale data) or purged
+// (returned to the OS with MADV_DONTNEED or never touched since mmap());
+// all other pages hold block metadata or user data and are live. Each
+// available block tracks the purged pages at its top end so splitting
+// and merging with the block above keep the counts exact; the purged
+// pages of the lower block of a merge are counted as dirty from then on
+// so counted dirty pages are an upper bound.
+typedef struct {
+  size_t pages;                 // pages in the heap
+  size_t live;                  // pages not wholly inside an available block
+  size_t dirty;                 // resident pages inside available blocks
+  size_t purged;                // non-resident pages inside available blocks
+} el_page_stats_t;
+
+// Page sharing of a heap offered to KSM, the kernel's same-page merging.
+// Per-heap counts come from /proc/self/pagemap: a resident page is
+// shared when it is mapped more than once, as after KSM merged it with
+// an identical page of this or another process. The process-wide counts
+// come from /proc/self/ksm_stat and are -1 when the kernel lacks it.
+typedef struct {
+  size_t pages;                 // whole pages of the heap offered for merging
+  size_t resident;              // those present in memory
+  size_t shared;                // resident pages mapped more than once
+  size_t unshared;              // resident pages mapped only here
+  long process_merging;         // ksm_merging_pages of the process
+  long process_profit;          // ksm_process_profit of the process in bytes
+} el_ksm_stats_t;
+
+// Cold-data hinting of a heap: totals hinted so far and the used blocks
+// that are still allocated with their pages hinted
+typedef struct {
+  unsigned short epoch;         // current epoch of the heap
+  size_t hinted_blocks;         // blocks hinted over the life of the heap
+  size_t hinted_pages;          // pages hinted over the life of the heap, counting renewed hints
+  size_t cold_blocks;           // used blocks currently hinted
+  size_t cold_pages;            // whole pages of those blocks
+} el_cold_stats_t;
+
+// Statistics of the signal-safe pool. Counters are updated with atomic
+// operations so may be read while handlers run.
+typedef struct {
+  size_t slots;                 // slots in the pool
+  size_t slot_bytes;            // bytes per slot, the largest allocation served
+  size_t used;                  // slots currently allocated
+  size_t peak;                  // most slots allocated at once
+  size_t allocs;                // successful el_sig_malloc() calls
+  size_t fails;                 // el_sig_malloc() calls returning NULL
+} el_sig_stats_t;
+
 // Main instance of el_ctl_t defined in el_malloc.c
 extern el_ctl_t el_ctl;
 
 // functions defined in el_malloc.c
 int el_init();
+int el_init_with_buffer(void *buf, size_t size);
+el_ctl_t *el_subheap_create(el_ctl_t *parent, size_t size);
+void el_subheap_destroy(el_ctl_t *sub);
+int el_set_conf(const char *conf);
 void el_print_stats();
 void el_cleanup();
 
+int el_set_hooks(const el_hooks_t *hooks);
+
+size_t *el_thread_allocatedp();
+size_t *el_thread_deallocatedp();
+
+int el_txn_begin();
+void el_txn_commit();
+void el_txn_abort();
+
+void el_lock_init(el_lock_t *lock);
+void el_lock(el_lock_t *lock);
+void el_unlock(el_lock_t *lock);
+void el_print_lock_stats();
+
+size_t el_block_pages(el_blockhead_t *block);
+size_t el_purge();
+void el_get_page_stats(el_page_stats_t *stats);
+int el_audit_pages(el_page_stats_t *stats);
+void el_print_page_stats();
+
 el_blockfoot_t *el_get_footer(el_blockhead_t *block);
 el_blockhead_t *el_get_header(el_blockfoot_t *foot);
 el_blockhead_t *el_block_above(el_blockhead_t *block);
@@ -94,11 +282,82 @@ void el_add_block_front(el_blocklist_t *list, el_blockhead_t *block);
 void el_remove_block(el_blocklist_t *list, el_blockhead_t *block);
 
 el_blockhead_t *el_find_first_avail(size_t size);
+el_blockhead_t *el_find_best_avail(size_t size);
+el_blockhead_t *el_find_avail(size_t size);
 el_blockhead_t *el_split_block(el_blockhead_t *block, size_t new_size);
 el_blockhead_t *el_allocate_block(size_t size);
+el_blockhead_t *el_split_tail(el_ctl_t *heap, el_blockhead_t *block, size_t nbytes, size_t top_purged);
 void *el_malloc(size_t nbytes);
+void *el_malloc_wait(size_t nbytes, long timeout_ns);
+void *el_malloc_aligned(size_t nbytes, size_t align);
+size_t el_usable_size(void *ptr);
+int el_expand(void *ptr, size_t nbytes);
+void *el_realloc(void *ptr, size_t nbytes);
+void *el_reserve(size_t max);
+size_t el_commit(void *ptr, size_t used);
+void *el_malloc_rc(size_t nbytes);
+void *el_retain(void *ptr);
+unsigned int el_release(void *ptr);
 
 void el_merge_block_with_above(el_blockhead_t *lower);
 void el_free(void *ptr);
+void el_free_batch(void **ptrs, size_t n);
+
+// versions of the above working on the given heap, either el_ctl or a
+// sub-heap
+el_blockhead_t *el_heap_block_above(el_ctl_t *heap, el_blockhead_t *block);
+el_blockhead_t *el_heap_block_below(el_ctl_t *heap, el_blockhead_t *block);
+el_blockhead_t *el_heap_find_first_avail(el_ctl_t *heap, size_t size);
+el_blockhead_t *el_heap_find_best_avail(el_ctl_t *heap, size_t size);
+el_blockhead_t *el_heap_find_avail(el_ctl_t *heap, size_t size);
+void *el_heap_malloc(el_ctl_t *heap, size_t nbytes);
+void *el_heap_malloc_aligned(el_ctl_t *heap, size_t nbytes, size_t align);
+int el_heap_expand(el_ctl_t *heap, void *ptr, size_t nbytes);
+void *el_heap_realloc(el_ctl_t *heap, void *ptr, size_t nbytes);
+size_t el_heap_commit(el_ctl_t *heap, void *ptr, size_t used);
+void *el_heap_malloc_rc(el_ctl_t *heap, size_t nbytes);
+unsigned int el_heap_release(el_ctl_t *heap, void *ptr);
+void el_heap_merge_block_with_above(el_ctl_t *heap, el_blockhead_t *lower);
+void el_heap_free(el_ctl_t *heap, void *ptr);
+void el_heap_free_batch(el_ctl_t *heap, void **ptrs, size_t n);
+size_t el_heap_purge(el_ctl_t *heap);
+void el_heap_get_page_stats(el_ctl_t *heap, el_page_stats_t *stats);
+int el_heap_audit_pages(el_ctl_t *heap, el_page_stats_t *stats);
+void el_heap_print_page_stats(el_ctl_t *heap);
+
+// versions of the above for callers already holding heap->lock
+void *el_heap_malloc_nolock(el_ctl_t *heap, size_t nbytes);
+int el_heap_expand_nolock(el_ctl_t *heap, void *ptr, size_t nbytes);
+int el_heap_free_nolock(el_ctl_t *heap, void *ptr);
+
+// lock-free size-class cache in front of el_ctl
+void *el_cache_pop(size_t nbytes);
+int el_cache_push(void *ptr);
+size_t el_cache_flush();
+size_t el_cache_flush_nolock();
+
+int el_heap_set_mergeable(el_ctl_t *heap);
+int el_heap_get_ksm_stats(el_ctl_t *heap, el_ksm_stats_t *stats);
+void el_heap_print_ksm_stats(el_ctl_t *heap);
+
+int el_heap_mark_cold(el_ctl_t *heap);
+size_t el_heap_cold_tick(el_ctl_t *heap);
+void el_heap_get_cold_stats(el_ctl_t *heap, el_cold_stats_t *stats);
+void el_heap_print_cold_stats(el_ctl_t *heap);
+size_t el_cold_tick();
+int el_cold_start();
+void el_cold_stop();
+
+// signal-safe pool kept apart from the heap
+void *el_sig_malloc(size_t nbytes);
+void el_sig_free(void *ptr);
+void el_sig_get_stats(el_sig_stats_t *stats);
+void el_print_sig_stats();
+
+int el_grow(size_t bytes, int prefault);
+int el_grow_nolock(size_t bytes);
+size_t el_grow_tick();
+int el_grow_start();
+void el_grow_stop();
 
 #endif // EL_MALLOC_H
@@ -0,0 +1,423 @@
+// el_shadow.c: metadata-only simulation of alternative fit policies.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "el_malloc.h"
+#include "el_shadow.h"
+
+// number of size bins of the binned policy; bin i holds blocks of
+// [2^i, 2^(i+1)) bytes
+#define NBINS 48
+
+// A block of a simulated heap. Blocks tile the heap in address order and
+// available blocks are also on a free list.
+typedef struct seg {
+  size_t off;                   // offset in the simulated heap
+  size_t size;                  // bytes including EL_BLOCK_OVERHEAD
+  size_t nbytes;                // bytes asked for if used
+  int free;
+  struct seg *prev, *next;      // neighbours in address order
+  struct seg *fprev, *fnext;    // neighbours on the free list
+} seg_t;
+
+typedef struct {
+  el_shadow_policy_t policy;
+  seg_t *last;                  // block at the top of the heap
+  seg_t *free[NBINS];           // free lists; only free[0] unless binned
+  seg_t *rover;                 // where the next fit search resumes
+  size_t extent;
+  size_t live;
+  size_t peak_extent;
+  size_t live_at_peak;
+  long mallocs;
+  long steps;
+} sim_t;
+
+// Entry of the map from sampled real block to its simulated blocks
+typedef struct {
+  void *ptr;                    // NULL if the entry is empty
+  seg_t *segs[EL_SHADOW_NPOLICIES];
+} entry_t;
+
+static const char *policy_names[EL_SHADOW_NPOLICIES] = {"first", "best", "next", "binned"};
+
+static struct {
+  int running;
+  int sample;                   // 1 in sample blocks is replayed
+  sim_t sims[EL_SHADOW_NPOLICIES];
+  entry_t *map;
+  size_t map_size;              // power of two
+  size_t map_used;
+  el_lock_t lock;               // hooks run concurrently on all threads
+} shadow = {};
+
+static size_t hash_ptr(void *ptr) {
+  return ((size_t) ptr * 0x9E3779B97F4A7C15UL) >> 16;
+}
+
+// Decide by address whether a block is sampled so its free is too
+static int sampled(void *ptr) {
+  return hash_ptr(ptr) % shadow.sample == 0;
+}
+
+static entry_t *map_find(void *ptr) {
+  size_t i = hash_ptr(ptr) & (shadow.map_size - 1);
+  while (shadow.map[i].ptr != NULL && shadow.map[i].ptr != ptr) {
+    i = (i + 1) & (shadow.map_size - 1);
+  }
+  return &shadow.map[i];
+}
+
+// Remove entry keeping linear probing intact by shifting back later
+// entries of the same run
+static void map_delete(entry_t *entry) {
+  size_t mask = shadow.map_size - 1;
+  size_t i = entry - shadow.map;
+  size_t j = i;
+  while (1) {
+    j = (j + 1) & mask;
+    if (shadow.map[j].ptr == NULL) {
+      break;
+    }
+    size_t home = hash_ptr(shadow.map[j].ptr) & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      shadow.map[i] = shadow.map[j];
+      i = j;
+    }
+  }
+  shadow.map[i].ptr = NULL;
+  shadow.map_used--;
+}
+
+// Double the map when half full. Returns -1 if no memory is available.
+static int map_grow() {
+  if (2 * (shadow.map_used + 1) <= shadow.map_size) {
+    return 0;
+  }
+  entry_t *old = shadow.map;
+  size_t old_size = shadow.map_size;
+  shadow.map_size = old_size > 0 ? 2 * old_size : 1024;
+  shadow.map = calloc(shadow.map_size, sizeof(entry_t));
+  if (shadow.map == NULL) {
+    shadow.map = old;
+    shadow.map_size = old_size;
+    return -1;
+  }
+  for (size_t i = 0; i < old_size; i++) {
+    if (old[i].ptr != NULL) {
+      *map_find(old[i].ptr) = old[i];
+    }
+  }
+  free(old);
+  return 0;
+}
+
+static int bin_of(sim_t *sim, size_t size) {
+  if (sim->policy != EL_SHADOW_BINNED) {
+    return 0;
+  }
+  int bin = 63 - __builtin_clzl(size);
+  return bin < NBINS ? bin : NBINS - 1;
+}
+
+static void free_insert(sim_t *sim, seg_t *seg) {
+  seg_t **head = &sim->free[bin_of(sim, seg->size)];
+  seg->fprev = NULL;
+  seg->fnext = *head;
+  if (*head != NULL) {
+    (*head)->fprev = seg;
+  }
+  *head = seg;
+  seg->free = 1;
+}
+
+static void free_remove(sim_t *sim, seg_t *seg) {
+  if (sim->rover == seg) {
+    sim->rover = seg->fnext;
+  }
+  if (seg->fprev != NULL) {
+    seg->fprev->fnext = seg->fnext;
+  } else {
+    sim->free[bin_of(sim, seg->size)] = seg->fnext;
+  }
+  if (seg->fnext != NULL) {
+    seg->fnext->fprev = seg->fprev;
+  }
+  seg->free = 0;
+}
+
+// Find an available block of at least need bytes by the policy of sim,
+// counting the blocks examined
+static seg_t *sim_search(sim_t *sim, size_t need) {
+  seg_t *found = NULL;
+  switch (sim->policy) {
+  case EL_SHADOW_FIRST:
+    for (seg_t *seg = sim->free[0]; seg != NULL && found == NULL; seg = seg->fnext) {
+      sim->steps++;
+      found = seg->size >= need ? seg : NULL;
+    }
+    break;
+  case EL_SHADOW_BEST:
+    for (seg_t *seg = sim->free[0]; seg != NULL; seg = seg->fnext) {
+      sim->steps++;
+      if (seg->size >= need && (found == NULL || seg->size < found->size)) {
+        found = seg;
+        if (seg->size == need) {
+          break;
+        }
+      }
+    }
+    break;
+  case EL_SHADOW_NEXT: {
+    seg_t *start = sim->rover != NULL ? sim->rover : sim->free[0];
+    seg_t *seg = start;
+    while (seg != NULL && found == NULL) {
+      sim->steps++;
+      found = seg->size >= need ? seg : NULL;
+      seg = seg->fnext != NULL ? seg->fnext : sim->free[0];
+      if (seg == start) {
+        break;
+      }
+    }
+    sim->rover = found != NULL ? found->fnext : sim->rover;
+    break;
+  }
+  case EL_SHADOW_BINNED:
+    for (int bin = bin_of(sim, need); bin < NBINS && found == NULL; bin++) {
+      for (seg_t *seg = sim->free[bin]; seg != NULL && found == NULL; seg = seg->fnext) {
+        sim->steps++;
+        found = seg->size >= need ? seg : NULL;
+      }
+    }
+    break;
+  default:
+    break;
+  }
+  return found;
+}
+
+// Place an allocation of nbytes in sim splitting off the remainder of
+// the block found like el_split_tail() does. The heap grows at the top
+// when nothing fits. Returns NULL if no memory is available.
+static seg_t *sim_malloc(sim_t *sim, size_t nbytes) {
+  size_t need = nbytes + EL_BLOCK_OVERHEAD;
+  sim->mallocs++;
+  seg_t *seg = sim_search(sim, need);
+  if (seg == NULL && sim->last != NULL && sim->last->free) {
+    seg = sim->last;
+    sim->extent += need - seg->size;
+    free_remove(sim, seg);
+    seg->size = need;
+  } else if (seg == NULL) {
+    seg = malloc(sizeof(seg_t));
+    if (seg == NULL) {
+      return NULL;
+    }
+    seg->off = sim->extent;
+    seg->size = need;
+    seg->free = 0;
+    seg->prev = sim->last;
+    seg->next = NULL;
+    if (sim->last != NULL) {
+      sim->last->next = seg;
+    }
+    sim->last = seg;
+    sim->extent += need;
+  } else {
+    free_remove(sim, seg);
+    seg_t *tail = seg->size >= need + EL_BLOCK_OVERHEAD ? malloc(sizeof(seg_t)) : NULL;
+    if (tail != NULL) {
+      tail->off = seg->off + need;
+      tail->size = seg->size - need;
+      tail->prev = seg;
+      tail->next = seg->next;
+      if (seg->next != NULL) {
+        seg->next->prev = tail;
+      } else {
+        sim->last = tail;
+      }
+      seg->next = tail;
+      seg->size = need;
+      free_insert(sim, tail);
+    }
+  }
+  seg->nbytes = nbytes;
+  sim->live += nbytes;
+  if (sim->extent > sim->peak_extent) {
+    sim->peak_extent = sim->extent;
+    sim->live_at_peak = sim->live;
+  }
+  return seg;
+}
+
+// Absorb the block above seg into seg. Neither may be on a free list;
+// callers take available blocks off theirs first.
+static void sim_merge(sim_t *sim, seg_t *seg) {
+  seg_t *above = seg->next;
+  seg->size += above->size;
+  seg->next = above->next;
+  if (above->next != NULL) {
+    above->next->prev = seg;
+  } else {
+    sim->last = seg;
+  }
+  free(above);
+}
+
+static void sim_free(sim_t *sim, seg_t *seg) {
+  sim->live -= seg->nbytes;
+  if (seg->next != NULL && seg->next->free) {
+    free_remove(sim, seg->next);
+    sim_merge(sim, seg);
+  }
+  if (seg->prev != NULL && seg->prev->free) {
+    // seg is not on a free list, only the block below is
+    seg = seg->prev;
+    free_remove(sim, seg);
+    sim_merge(sim, seg);
+  }
+  free_insert(sim, seg);
+}
+
+static void sim_reset(sim_t *sim, el_shadow_policy_t policy) {
+  for (seg_t *seg = sim->last; seg != NULL; ) {
+    seg_t *prev = seg->prev;
+    free(seg);
+    seg = prev;
+  }
+  sim_t empty = {};
+  *sim = empty;
+  sim->policy = policy;
+}
+
+// Replay an allocation of nbytes at ptr on every simulated heap
+static void shadow_malloc(void *ptr, size_t nbytes) {
+  if (map_grow() != 0) {
+    return;
+  }
+  entry_t *entry = map_find(ptr);
+  entry->ptr = ptr;
+  shadow.map_used++;
+  for (int p = 0; p < EL_SHADOW_NPOLICIES; p++) {
+    entry->segs[p] = sim_malloc(&shadow.sims[p], nbytes);
+  }
+}
+
+static void shadow_free(void *ptr) {
+  entry_t *entry = map_find(ptr);
+  if (entry->ptr == NULL) {
+    return;                     // allocated before shadow mode started
+  }
+  for (int p = 0; p < EL_SHADOW_NPOLICIES; p++) {
+    if (entry->segs[p] != NULL) {
+      sim_free(&shadow.sims[p], entry->segs[p]);
+    }
+  }
+  map_delete(entry);
+}
+
+static void hook_malloc(void *ptr, size_t nbytes, void *arg) {
+  if (sampled(ptr)) {
+    el_lock(&shadow.lock);
+    shadow_malloc(ptr, nbytes);
+    el_unlock(&shadow.lock);
+  }
+}
+
+static void hook_free(void *ptr, void *arg) {
+  if (sampled(ptr)) {
+    el_lock(&shadow.lock);
+    shadow_free(ptr);
+    el_unlock(&shadow.lock);
+  }
+}
+
+// A resize is replayed as a free of the old block and an allocation of
+// the new size
+static void hook_realloc(void *old_ptr, void *new_ptr, size_t nbytes, void *arg) {
+  if (sampled(old_ptr) || sampled(new_ptr)) {
+    el_lock(&shadow.lock);
+    if (sampled(old_ptr)) {
+      shadow_free(old_ptr);
+    }
+    if (sampled(new_ptr)) {
+      shadow_malloc(new_ptr, nbytes);
+    }
+    el_unlock(&shadow.lock);
+  }
+}
+
+// Start shadow mode replaying 1 in sample of the blocks allocated from
+// now on; blocks already allocated are not seen. Any earlier simulation
+// is discarded. Returns 0 on success and -1 if sample is not positive
+// or the hooks were compiled out.
+int el_shadow_start(int sample) {
+  if (sample <= 0) {
+    return -1;
+  }
+  el_shadow_stop();
+  for (int p = 0; p < EL_SHADOW_NPOLICIES; p++) {
+    sim_reset(&shadow.sims[p], p);
+  }
+  free(shadow.map);
+  shadow.map = NULL;
+  shadow.map_size = 0;
+  shadow.map_used = 0;
+  shadow.sample = sample;
+  el_lock_init(&shadow.lock);
+  el_hooks_t hooks = {hook_malloc, hook_free, hook_realloc, NULL};
+  if (el_set_hooks(&hooks) != 0) {
+    return -1;
+  }
+  shadow.running = 1;
+  return 0;
+}
+
+// Stop feeding the simulation and remove its hooks. The statistics
+// stay available.
+void el_shadow_stop() {
+  if (shadow.running) {
+    el_set_hooks(NULL);
+    shadow.running = 0;
+  }
+}
+
+// Fill stats with the state of each simulated policy
+void el_shadow_get_stats(el_shadow_stats_t stats[EL_SHADOW_NPOLICIES]) {
+  el_lock(&shadow.lock);
+  for (int p = 0; p < EL_SHADOW_NPOLICIES; p++) {
+    sim_t *sim = &shadow.sims[p];
+    stats[p].name = policy_names[p];
+    stats[p].mallocs = sim->mallocs;
+    stats[p].search = sim->mallocs > 0 ? (double) sim->steps / sim->mallocs : 0;
+    stats[p].extent = sim->extent;
+    stats[p].live = sim->live;
+    stats[p].peak_extent = sim->peak_extent;
+    stats[p].frag = sim->peak_extent > 0 ? 1 - (double) sim->live_at_peak / sim->peak_extent : 0;
+  }
+  el_unlock(&shadow.lock);
+}
+
+// Print the simulated policies next to each other in the following
+// format. The row marked * simulates the policy el is configured with;
+// like the others its numbers come from the simulated heap, not from el.
+//
+// SHADOW STATS (sample: 1 in 1)
+// policy      mallocs   search   extent     live  peak_ext    frag
+// first  *        120     3.41     6120     2400      7360   0.412
+// best            120     5.02     5880     2400      6840   0.368
+// * simulates the policy of el
+void el_shadow_print_stats() {
+  el_shadow_stats_t stats[EL_SHADOW_NPOLICIES];
+  el_shadow_get_stats(stats);
+  int same = el_ctl.fit == EL_FIT_BEST ? EL_SHADOW_BEST : EL_SHADOW_FIRST;
+  printf("SHADOW STATS (sample: 1 in %d)\n", shadow.sample);
+  printf("%-8s %10s %8s %8s %8s %9s %7s\n",
+         "policy", "mallocs", "search", "extent", "live", "peak_ext", "frag");
+  for (int p = 0; p < EL_SHADOW_NPOLICIES; p++) {
+    printf("%-6s %c %10ld %8.2f %8lu %8lu %9lu %7.3f\n", stats[p].name,
+           p == same ? '*' : ' ', stats[p].mallocs, stats[p].search,
+           stats[p].extent, stats[p].live, stats[p].peak_extent, stats[p].frag);
+  }
+  printf("* simulates the policy of el\n");
+}
@@ -0,0 +1,43 @@
+#ifndef EL_SHADOW_H
+#define EL_SHADOW_H
+
+// Shadow policy simulation. While running, a sample of the blocks that
+// el_malloc()/el_free() hand out is replayed against simulated heaps that
+// hold only block metadata, one per placement policy, so alternatives to
+// the live fit policy can be judged on production traffic without
+// switching. Blocks are sampled by address so the free of a sampled
+// block is always seen. The simulated heaps grow without bound instead
+// of failing; fragmentation is the share of the simulated heap extent
+// not holding live data when the extent peaked.
+//
+// Shadow mode receives events through the allocation hooks (see
+// el_set_hooks()) so it replaces any other hooks while it runs.
+
+#include <stddef.h>
+
+// placement policies simulated
+typedef enum {
+  EL_SHADOW_FIRST,              // first fit in a LIFO available list, as el does
+  EL_SHADOW_BEST,               // smallest block that fits
+  EL_SHADOW_NEXT,               // first fit resuming where the last search stopped
+  EL_SHADOW_BINNED,             // first fit in power of two size bins
+  EL_SHADOW_NPOLICIES
+} el_shadow_policy_t;
+
+typedef struct {
+  const char *name;
+  long mallocs;                 // sampled allocations replayed
+  double search;                // available blocks examined per allocation
+  size_t extent;                // bytes spanned by the simulated heap
+  size_t live;                  // bytes of sampled blocks currently allocated
+  size_t peak_extent;           // largest extent reached
+  double frag;                  // 1 - live / extent when the extent peaked
+} el_shadow_stats_t;
+
+// functions defined in el_shadow.c
+int el_shadow_start(int sample);
+void el_shadow_stop();
+void el_shadow_get_stats(el_shadow_stats_t stats[EL_SHADOW_NPOLICIES]);
+void el_shadow_print_stats();
+
+#endif // EL_SHADOW_H
@@ -0,0 +1,163 @@
+// el_slab.c: object caches keeping freed objects constructed.
+
+#include "el_malloc.h"
+#include "el_slab.h"
+
+// Pointer to the object held in slot
+#define SLOT_OBJ(slot) PTR_PLUS_BYTES(slot, sizeof(el_slot_t))
+
+// Pointer to slot i of slab
+#define SLAB_SLOT(cache, slab, i) \
+  ((el_slot_t *) PTR_PLUS_BYTES(slab, sizeof(el_slab_t) + (i) * (cache)->slot))
+
+static void slab_link(el_slab_t **list, el_slab_t *slab) {
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list != NULL) {
+    (*list)->prev = slab;
+  }
+  *list = slab;
+}
+
+static void slab_unlink(el_slab_t **list, el_slab_t *slab) {
+  if (slab->prev != NULL) {
+    slab->prev->next = slab->next;
+  } else {
+    *list = slab->next;
+  }
+  if (slab->next != NULL) {
+    slab->next->prev = slab->prev;
+  }
+}
+
+// Create a cache of objects of size bytes. ctor is run on every object
+// when the slab holding it is created and dtor when that slab is
+// reclaimed; either may be NULL. Returns NULL if no memory is available.
+el_objcache_t *el_objcache_create(size_t size, void (*ctor)(void *), void (*dtor)(void *)) {
+  // the lock word must be aligned for atomics and futex(2)
+  el_objcache_t *cache = el_malloc_aligned(sizeof(el_objcache_t), EL_ALIGN);
+  if (cache == NULL) {
+    return NULL;
+  }
+  cache->size = size;
+  // slabs are aligned and so are the headers in them, keep the objects
+  // aligned as el_malloc_aligned() would
+  cache->slot = EL_ALIGN_UP(sizeof(el_slot_t) + size);
+  cache->per_slab = (EL_SLAB_BYTES - sizeof(el_slab_t)) / cache->slot;
+  cache->per_slab = cache->per_slab > 0 ? cache->per_slab : 1;
+  cache->ctor = ctor;
+  cache->dtor = dtor;
+  cache->partial = NULL;
+  cache->full = NULL;
+  cache->empty = NULL;
+  cache->slabs = 0;
+  cache->constructed = 0;
+  cache->destructed = 0;
+  el_lock_init(&cache->lock);
+  return cache;
+}
+
+// Allocate a slab for cache and construct all of its objects. Returns
+// NULL if no memory is available.
+static el_slab_t *slab_create(el_objcache_t *cache) {
+  el_slab_t *slab = el_malloc_aligned(sizeof(el_slab_t) + cache->per_slab * cache->slot, EL_ALIGN);
+  if (slab == NULL) {
+    return NULL;
+  }
+  slab->free = NULL;
+  for (size_t i = cache->per_slab; i > 0; i--) {
+    el_slot_t *slot = SLAB_SLOT(cache, slab, i - 1);
+    slot->slab = slab;
+    slot->next = slab->free;
+    slab->free = slot;
+    if (cache->ctor != NULL) {
+      cache->ctor(SLOT_OBJ(slot));
+    }
+  }
+  slab->nfree = cache->per_slab;
+  cache->constructed += cache->per_slab;
+  cache->slabs++;
+  return slab;
+}
+
+// Destroy all objects of slab and return it to the heap
+static void slab_destroy(el_objcache_t *cache, el_slab_t *slab) {
+  if (cache->dtor != NULL) {
+    for (size_t i = 0; i < cache->per_slab; i++) {
+      cache->dtor(SLOT_OBJ(SLAB_SLOT(cache, slab, i)));
+    }
+  }
+  cache->destructed += cache->per_slab;
+  cache->slabs--;
+  el_free(slab);
+}
+
+// Return a constructed object from cache, preferring partially used
+// slabs so empty ones can be reaped. The object is in the state the
+// constructor or its last user left it. Returns NULL if a new slab is
+// needed and no memory is available.
+void *el_objcache_alloc(el_objcache_t *cache) {
+  el_lock(&cache->lock);
+  el_slab_t *slab = cache->partial;
+  if (slab != NULL) {
+    slab_unlink(&cache->partial, slab);
+  } else if (cache->empty != NULL) {
+    slab = cache->empty;
+    slab_unlink(&cache->empty, slab);
+  } else {
+    slab = slab_create(cache);
+    if (slab == NULL) {
+      el_unlock(&cache->lock);
+      return NULL;
+    }
+  }
+  el_slot_t *slot = slab->free;
+  slab->free = slot->next;
+  slab->nfree--;
+  slab_link(slab->nfree > 0 ? &cache->partial : &cache->full, slab);
+  el_unlock(&cache->lock);
+  return SLOT_OBJ(slot);
+}
+
+// Return obj to cache. It is not destructed and must be left in its
+// constructed state by the caller.
+void el_objcache_free(el_objcache_t *cache, void *obj) {
+  el_slot_t *slot = PTR_MINUS_BYTES(obj, sizeof(el_slot_t));
+  el_slab_t *slab = slot->slab;
+  el_lock(&cache->lock);
+  slab_unlink(slab->nfree > 0 ? &cache->partial : &cache->full, slab);
+  slot->next = slab->free;
+  slab->free = slot;
+  slab->nfree++;
+  slab_link(slab->nfree == cache->per_slab ? &cache->empty : &cache->partial, slab);
+  el_unlock(&cache->lock);
+}
+
+// Destruct the objects of all empty slabs of cache and return the slabs
+// to the heap. Returns the number of slabs reclaimed.
+size_t el_objcache_reap(el_objcache_t *cache) {
+  el_lock(&cache->lock);
+  size_t n = 0;
+  while (cache->empty != NULL) {
+    el_slab_t *slab = cache->empty;
+    slab_unlink(&cache->empty, slab);
+    slab_destroy(cache, slab);
+    n++;
+  }
+  el_unlock(&cache->lock);
+  return n;
+}
+
+// Destruct every object of cache, whether free or not, and release all
+// of its memory
+void el_objcache_destroy(el_objcache_t *cache) {
+  el_slab_t **lists[3] = {&cache->partial, &cache->full, &cache->empty};
+  for (int i = 0; i < 3; i++) {
+    while (*lists[i] != NULL) {
+      el_slab_t *slab = *lists[i];
+      slab_unlink(lists[i], slab);
+      slab_destroy(cache, slab);
+    }
+  }
+  el_free(cache);
+}
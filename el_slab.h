@@ -0,0 +1,58 @@
+#ifndef EL_SLAB_H
+#define EL_SLAB_H
+
+// Object caches in the style of Bonwick's slab allocator on top of
+// el_malloc(). A cache hands out objects of one size carved from slabs,
+// each a single el block. Objects are constructed once when their slab
+// is created and stay constructed while cached: el_objcache_free() keeps
+// them as they are so the next el_objcache_alloc() skips initialization.
+// The destructor runs only when el_objcache_reap() or el_objcache_destroy()
+// gives a slab back to the heap.
+
+#include <stddef.h>
+#include "el_malloc.h"
+
+// bytes of objects and their headers aimed for in one slab; a slab holds
+// at least one object whatever its size
+#define EL_SLAB_BYTES  ((size_t) 1024)
+
+struct el_slab;
+
+// Header in front of each object; the object itself is never written by
+// the cache so its constructed state survives being freed
+typedef struct el_slot {
+  struct el_slab *slab;         // slab holding the object
+  struct el_slot *next;         // next free object of the slab while free
+} el_slot_t;
+
+// A slab: this header followed by per_slab slots
+typedef struct el_slab {
+  struct el_slab *next;         // neighbours in the cache list the slab is on
+  struct el_slab *prev;
+  el_slot_t *free;              // free objects; NULL if all are allocated
+  size_t nfree;                 // number of free objects
+} el_slab_t;
+
+typedef struct {
+  size_t size;                  // object size in bytes
+  size_t slot;                  // bytes per object including its el_slot_t
+  size_t per_slab;              // objects per slab
+  void (*ctor)(void *obj);      // run once on each object of a new slab; may be NULL
+  void (*dtor)(void *obj);      // run on each object of a reclaimed slab; may be NULL
+  el_slab_t *partial;           // slabs with allocated and free objects
+  el_slab_t *full;              // slabs with no free objects
+  el_slab_t *empty;             // slabs with only free objects
+  size_t slabs;                 // slabs currently held
+  size_t constructed;           // ctor calls over the life of the cache
+  size_t destructed;            // dtor calls over the life of the cache
+  el_lock_t lock;
+} el_objcache_t;
+
+// functions defined in el_slab.c
+el_objcache_t *el_objcache_create(size_t size, void (*ctor)(void *), void (*dtor)(void *));
+void *el_objcache_alloc(el_objcache_t *cache);
+void el_objcache_free(el_objcache_t *cache, void *obj);
+size_t el_objcache_reap(el_objcache_t *cache);
+void el_objcache_destroy(el_objcache_t *cache);
+
+#endif // EL_SLAB_H
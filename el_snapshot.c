@@ -0,0 +1,481 @@
+// el_snapshot.c: saving the heap to a file and restoring it, either
+// eagerly or lazily by serving page faults from the snapshot file with
+// userfaultfd.
+//
+// A lazy restore maps the heap region, registers it with userfaultfd and
+// returns as soon as el_ctl is set up. A handler thread fills each page
+// from the file on first touch while a prefetcher thread copies the
+// remaining pages in the hot-page order stored in the snapshot. The
+// order of the faults taken during a lazy restore is remembered and
+// written by the next el_snapshot_save() so later restores prefetch the
+// pages the application actually needed first.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "el_malloc.h"
+#include "el_snapshot.h"
+
+// State of a lazy restore in progress along with the fault order
+// recorded by the most recent one.
+typedef struct {
+  int active;                   // 1 while handler/prefetcher threads run
+  int uffd;                     // userfaultfd for the heap region
+  int fd;                       // snapshot file being restored
+  el_snapshot_header_t hdr;     // header of that file
+  size_t *order;                // prefetch order read from the file
+  unsigned char *present;       // per page, 1 once it has been filled
+  size_t done;                  // pages filled so far; atomic
+  int error;                    // errno of a page that could not be filled; atomic
+  size_t *faults;               // pages in the order they faulted
+  size_t nfaults;
+  size_t fault_pages;           // number of pages faults refers to
+  pthread_t handler;
+  pthread_t prefetcher;
+} el_snap_t;
+
+static el_snap_t el_snap = {.uffd = -1, .fd = -1};
+
+// Write all of buf to fd; returns -1 on error
+static int write_all(int fd, const void *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    buf = PTR_PLUS_BYTES(buf, n);
+    len -= n;
+  }
+  return 0;
+}
+
+// Read all of len bytes at offset off of fd into buf; returns -1 on error
+static int pread_all(int fd, void *buf, size_t len, off_t off) {
+  while (len > 0) {
+    ssize_t n = pread(fd, buf, len, off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    buf = PTR_PLUS_BYTES(buf, n);
+    len -= n;
+    off += n;
+  }
+  return 0;
+}
+
+// Write the heap and its list metadata to path. The prefetch order
+// written is the fault order of the last lazy restore, if any, followed
+// by all remaining pages in address order. Waits for a lazy restore in
+// progress to finish first and fails if it did not. The heap is written
+// under el_ctl.lock so concurrent allocations cannot tear the image.
+// Returns 0 on success and -1 on error.
+int el_snapshot_save(const char *path) {
+  if (el_snapshot_wait() != 0) {
+    fprintf(stderr,"el_snapshot_save: heap was not fully restored\n");
+    return -1;
+  }
+  el_cache_flush();             // cached blocks live only in el_malloc.c
+  el_lock(&el_ctl.lock);
+  el_snapshot_header_t hdr = {};
+  size_t page = sysconf(_SC_PAGESIZE);
+  memcpy(hdr.magic, EL_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+  hdr.heap_start = el_ctl.heap_start;
+  hdr.heap_bytes = el_ctl.heap_bytes;
+  hdr.page_size = page;
+  hdr.npages = (el_ctl.heap_bytes + page - 1) / page;
+  size_t meta = sizeof(hdr) + hdr.npages * sizeof(size_t);
+  hdr.data_offset = (meta + page - 1) / page * page;
+  if (el_ctl.avail->length > 0) {
+    hdr.avail_first = el_ctl.avail->beg->next;
+    hdr.avail_last = el_ctl.avail->end->prev;
+  }
+  hdr.avail_length = el_ctl.avail->length;
+  hdr.avail_bytes = el_ctl.avail->bytes;
+  hdr.avail_pages = el_ctl.avail->pages;
+  if (el_ctl.used->length > 0) {
+    hdr.used_first = el_ctl.used->beg->next;
+    hdr.used_last = el_ctl.used->end->prev;
+  }
+  hdr.used_length = el_ctl.used->length;
+  hdr.used_bytes = el_ctl.used->bytes;
+  hdr.used_pages = el_ctl.used->pages;
+  hdr.purged_pages = el_ctl.purged_pages;
+  hdr.fit = el_ctl.fit;
+  hdr.split_min = el_ctl.split_min;
+
+  // hot pages first, then the rest in address order
+  size_t *order = malloc(hdr.npages * sizeof(size_t));
+  unsigned char *seen = calloc(hdr.npages, 1);
+  if (order == NULL || seen == NULL) {
+    el_unlock(&el_ctl.lock);
+    fprintf(stderr, "el_snapshot_save: no memory for the page order\n");
+    free(order);
+    free(seen);
+    return -1;
+  }
+  size_t n = 0;
+  if (el_snap.fault_pages == hdr.npages) {
+    for (size_t i = 0; i < el_snap.nfaults; i++) {
+      seen[el_snap.faults[i]] = 1;
+      order[n++] = el_snap.faults[i];
+    }
+  }
+  for (size_t i = 0; i < hdr.npages; i++) {
+    if (!seen[i]) {
+      order[n++] = i;
+    }
+  }
+  free(seen);
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    el_unlock(&el_ctl.lock);
+    perror("el_snapshot_save");
+    free(order);
+    return -1;
+  }
+  char zeros[64] = {};
+  size_t pad = hdr.data_offset - meta;
+  int ret = write_all(fd, &hdr, sizeof(hdr));
+  ret = ret || write_all(fd, order, hdr.npages * sizeof(size_t));
+  for (; ret == 0 && pad > 0; pad -= pad < sizeof(zeros) ? pad : sizeof(zeros)) {
+    ret = write_all(fd, zeros, pad < sizeof(zeros) ? pad : sizeof(zeros));
+  }
+  ret = ret || write_all(fd, el_ctl.heap_start, el_ctl.heap_bytes);
+  el_unlock(&el_ctl.lock);
+  if (ret != 0) {
+    perror("el_snapshot_save");
+  }
+  close(fd);
+  free(order);
+  return ret ? -1 : 0;
+}
+
+// Open path, read and check its header and map an empty heap region at
+// the address it was saved from. Returns the open file or -1 on error.
+static int snapshot_open(const char *path, el_snapshot_header_t *hdr) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror("el_snapshot_restore");
+    return -1;
+  }
+  if (pread_all(fd, hdr, sizeof(*hdr), 0) != 0 ||
+      memcmp(hdr->magic, EL_SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0) {
+    fprintf(stderr,"el_snapshot_restore: %s is not a heap snapshot\n", path);
+    close(fd);
+    return -1;
+  }
+  if (hdr->page_size != sysconf(_SC_PAGESIZE)) {
+    fprintf(stderr,"el_snapshot_restore: snapshot page size %lu differs from %ld\n",
+            hdr->page_size, sysconf(_SC_PAGESIZE));
+    close(fd);
+    return -1;
+  }
+  void *heap = mmap(hdr->heap_start, hdr->npages * hdr->page_size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+  if (heap != hdr->heap_start) {
+    fprintf(stderr,"el_snapshot_restore: heap address %p is not free\n", hdr->heap_start);
+    if (heap != MAP_FAILED) {
+      munmap(heap, hdr->npages * hdr->page_size);
+    }
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Set up el_ctl from the header. Every field not saved starts from its
+// default as after el_init() so nothing carries over from the heap in
+// use before. Relinking the list ends writes to at most four blocks in
+// the heap which, during a lazy restore, are faulted in through the
+// handler like any other access.
+static void snapshot_set_ctl(el_snapshot_header_t *hdr) {
+  el_ctl_t fresh = {};
+  el_ctl = fresh;
+  el_ctl.cold_advice = MADV_COLD;
+  el_ctl.heap_start = hdr->heap_start;
+  el_ctl.heap_owned = 1;
+  el_ctl.parent = NULL;
+  el_ctl.heap_bytes = hdr->heap_bytes;
+  el_ctl.heap_end = PTR_PLUS_BYTES(hdr->heap_start, hdr->heap_bytes);
+  el_ctl.fit = hdr->fit;
+  el_ctl.split_min = hdr->split_min;
+  el_ctl.purged_pages = hdr->purged_pages;
+  el_lock_init(&el_ctl.lock);
+  el_init_blocklist(&el_ctl.avail_actual);
+  el_init_blocklist(&el_ctl.used_actual);
+  el_ctl.avail = &el_ctl.avail_actual;
+  el_ctl.used = &el_ctl.used_actual;
+
+  el_blocklist_t *lists[2] = {el_ctl.avail, el_ctl.used};
+  el_blockhead_t *firsts[2] = {hdr->avail_first, hdr->used_first};
+  el_blockhead_t *lasts[2] = {hdr->avail_last, hdr->used_last};
+  size_t lengths[2] = {hdr->avail_length, hdr->used_length};
+  size_t bytes[2] = {hdr->avail_bytes, hdr->used_bytes};
+  size_t pages[2] = {hdr->avail_pages, hdr->used_pages};
+  for (int i = 0; i < 2; i++) {
+    el_blocklist_t *list = lists[i];
+    list->length = lengths[i];
+    list->bytes = bytes[i];
+    list->pages = pages[i];
+    if (firsts[i] != NULL) {
+      list->beg->next = firsts[i];
+      firsts[i]->prev = list->beg;
+      list->end->prev = lasts[i];
+      lasts[i]->next = list->end;
+    }
+  }
+}
+
+// Restore a snapshot by reading the whole heap image up front. The heap
+// must not currently be initialized. Returns 0 on success and -1 on error.
+int el_snapshot_restore(const char *path) {
+  el_snapshot_header_t hdr;
+  int fd = snapshot_open(path, &hdr);
+  if (fd < 0) {
+    return -1;
+  }
+  if (pread_all(fd, hdr.heap_start, hdr.heap_bytes, hdr.data_offset) != 0) {
+    perror("el_snapshot_restore");
+    munmap(hdr.heap_start, hdr.npages * hdr.page_size);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  snapshot_set_ctl(&hdr);
+  return 0;
+}
+
+// Fill page idx of the heap from the snapshot file. Either thread may
+// lose the race for a page in which case the kernel reports EEXIST and
+// the faulting thread, if any, is woken explicitly. Any other failure is
+// recorded in el_snap.error which stops both threads. Returns -1 on such
+// a failure.
+static int snapshot_fill_page(size_t idx, void *buf) {
+  size_t page = el_snap.hdr.page_size;
+  void *dst = PTR_PLUS_BYTES(el_snap.hdr.heap_start, idx * page);
+  if (__atomic_load_n(&el_snap.present[idx], __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  memset(buf, 0, page);         // last page may be partial in the file
+  size_t len = el_snap.hdr.heap_bytes - idx * page;
+  if (pread_all(el_snap.fd, buf, len < page ? len : page, el_snap.hdr.data_offset + idx * page) != 0) {
+    __atomic_store_n(&el_snap.error, errno != 0 ? errno : EIO, __ATOMIC_RELEASE);
+    return -1;
+  }
+  struct uffdio_copy copy = {
+    .dst = (unsigned long) dst,
+    .src = (unsigned long) buf,
+    .len = page,
+    .mode = 0,
+  };
+  if (ioctl(el_snap.uffd, UFFDIO_COPY, &copy) == 0) {
+    __atomic_add_fetch(&el_snap.done, 1, __ATOMIC_ACQ_REL);
+  } else if (errno == EEXIST) {
+    struct uffdio_range range = {.start = (unsigned long) dst, .len = page};
+    ioctl(el_snap.uffd, UFFDIO_WAKE, &range);
+  } else {
+    __atomic_store_n(&el_snap.error, errno, __ATOMIC_RELEASE);
+    return -1;
+  }
+  __atomic_store_n(&el_snap.present[idx], 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// 1 once every page is filled or filling has failed
+static int snapshot_finished() {
+  return __atomic_load_n(&el_snap.done, __ATOMIC_ACQUIRE) >= el_snap.hdr.npages ||
+    __atomic_load_n(&el_snap.error, __ATOMIC_ACQUIRE) != 0;
+}
+
+// Serve page faults until every page has been filled or filling failed,
+// recording the order in which pages were first touched.
+static void *snapshot_handler(void *arg) {
+  void *buf = aligned_alloc(el_snap.hdr.page_size, el_snap.hdr.page_size);
+  if (buf == NULL) {
+    __atomic_store_n(&el_snap.error, ENOMEM, __ATOMIC_RELEASE);
+  }
+  while (!snapshot_finished()) {
+    struct pollfd pfd = {.fd = el_snap.uffd, .events = POLLIN};
+    if (poll(&pfd, 1, 50) <= 0) {
+      continue;                 // timeout lets the loop notice completion
+    }
+    struct uffd_msg msg;
+    if (read(el_snap.uffd, &msg, sizeof(msg)) != sizeof(msg) ||
+        msg.event != UFFD_EVENT_PAGEFAULT) {
+      continue;
+    }
+    size_t idx = PTR_MINUS_PTR((void *) (size_t) msg.arg.pagefault.address,
+                               el_snap.hdr.heap_start) / el_snap.hdr.page_size;
+    if (!__atomic_load_n(&el_snap.present[idx], __ATOMIC_ACQUIRE)) {
+      el_snap.faults[el_snap.nfaults++] = idx;
+    }
+    snapshot_fill_page(idx, buf);
+  }
+  free(buf);
+  return NULL;
+}
+
+// Fill all pages in the hot-page order of the snapshot
+static void *snapshot_prefetcher(void *arg) {
+  void *buf = aligned_alloc(el_snap.hdr.page_size, el_snap.hdr.page_size);
+  if (buf == NULL) {
+    __atomic_store_n(&el_snap.error, ENOMEM, __ATOMIC_RELEASE);
+  }
+  for (size_t i = 0; buf != NULL && i < el_snap.hdr.npages; i++) {
+    if (snapshot_fill_page(el_snap.order[i], buf) != 0) {
+      break;
+    }
+  }
+  free(buf);
+  return NULL;
+}
+
+// Open a userfaultfd registered for missing-page faults on the heap
+// region; returns -1 if userfaultfd is unavailable. Falls back to a
+// user-mode-only userfaultfd which unprivileged processes may get; with
+// one, system calls that touch an unfilled heap page (e.g. read(2) into
+// a block) fail with EFAULT until the prefetcher has reached that page.
+static int snapshot_open_uffd(el_snapshot_header_t *hdr) {
+  int uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  if (uffd < 0) {
+    uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+  }
+  if (uffd < 0) {
+    return -1;
+  }
+  struct uffdio_api api = {.api = UFFD_API, .features = 0};
+  struct uffdio_register reg = {
+    .range = {.start = (unsigned long) hdr->heap_start,
+              .len = hdr->npages * hdr->page_size},
+    .mode = UFFDIO_REGISTER_MODE_MISSING,
+  };
+  if (ioctl(uffd, UFFDIO_API, &api) != 0 || ioctl(uffd, UFFDIO_REGISTER, &reg) != 0) {
+    close(uffd);
+    return -1;
+  }
+  return uffd;
+}
+
+// Give up on a lazy restore of path before it started: release what was
+// set up for it, including the heap region, and restore eagerly instead.
+// uffd may be -1 if none was opened. Returns as el_snapshot_restore_lazy().
+static int snapshot_restore_eager(const char *path, el_snapshot_header_t *hdr, int fd, int uffd) {
+  if (uffd >= 0) {
+    close(uffd);
+  }
+  close(fd);
+  munmap(hdr->heap_start, hdr->npages * hdr->page_size);
+  free(el_snap.order);
+  free(el_snap.present);
+  free(el_snap.faults);
+  el_snap.order = NULL;
+  el_snap.present = NULL;
+  el_snap.faults = NULL;
+  el_snap.nfaults = 0;
+  el_snap.fault_pages = 0;
+  el_snap.uffd = -1;
+  el_snap.fd = -1;
+  el_snap.error = 0;
+  return el_snapshot_restore(path) == 0 ? 1 : -1;
+}
+
+// Restore a snapshot lazily: el_ctl is usable as soon as this returns
+// while heap pages are filled from the file on first touch and by a
+// background prefetcher. Call el_snapshot_wait() before el_cleanup().
+// If userfaultfd is not available (e.g. vm.unprivileged_userfaultfd=0
+// and no privileges) the snapshot is restored eagerly instead. Returns 0
+// for a lazy restore, 1 for an eager one and -1 on error. Running out of
+// memory or threads for the lazy restore also falls back to an eager one.
+int el_snapshot_restore_lazy(const char *path) {
+  el_snapshot_wait();
+  el_snapshot_header_t hdr;
+  int fd = snapshot_open(path, &hdr);
+  if (fd < 0) {
+    return -1;
+  }
+  int uffd = snapshot_open_uffd(&hdr);
+  if (uffd < 0) {
+    return snapshot_restore_eager(path, &hdr, fd, -1);
+  }
+
+  el_snap.hdr = hdr;
+  el_snap.fd = fd;
+  el_snap.uffd = uffd;
+  el_snap.done = 0;
+  el_snap.error = 0;
+  el_snap.order = malloc(hdr.npages * sizeof(size_t));
+  el_snap.present = calloc(hdr.npages, 1);
+  free(el_snap.faults);
+  el_snap.faults = malloc(hdr.npages * sizeof(size_t));
+  el_snap.nfaults = 0;
+  el_snap.fault_pages = hdr.npages;
+  if (el_snap.order == NULL || el_snap.present == NULL || el_snap.faults == NULL) {
+    return snapshot_restore_eager(path, &hdr, fd, uffd);
+  }
+  if (pread_all(fd, el_snap.order, hdr.npages * sizeof(size_t), sizeof(hdr)) != 0) {
+    for (size_t i = 0; i < hdr.npages; i++) {
+      el_snap.order[i] = i;
+    }
+  }
+  for (size_t i = 0; i < hdr.npages; i++) { // never trust the file for indices
+    el_snap.order[i] = el_snap.order[i] < hdr.npages ? el_snap.order[i] : i;
+  }
+
+  // the heap is installed only once both threads run, as a touch of a
+  // missing page would otherwise wait forever
+  if (pthread_create(&el_snap.handler, NULL, snapshot_handler, NULL) != 0) {
+    return snapshot_restore_eager(path, &hdr, fd, uffd);
+  }
+  if (pthread_create(&el_snap.prefetcher, NULL, snapshot_prefetcher, NULL) != 0) {
+    __atomic_store_n(&el_snap.error, ECANCELED, __ATOMIC_RELEASE);     // stops the handler
+    pthread_join(el_snap.handler, NULL);
+    return snapshot_restore_eager(path, &hdr, fd, uffd);
+  }
+  el_snap.active = 1;
+  snapshot_set_ctl(&hdr);
+  return 0;
+}
+
+// Wait for a lazy restore in progress to have filled every page and
+// release its resources. If a page could not be filled the restore is
+// abandoned: closing the userfaultfd lets threads blocked on unfilled
+// pages go on with zero pages, so the heap must not be trusted. Returns
+// 0 on success or if no lazy restore is in progress and -1 if it failed.
+int el_snapshot_wait() {
+  if (!el_snap.active) {
+    return 0;
+  }
+  pthread_join(el_snap.prefetcher, NULL);
+  pthread_join(el_snap.handler, NULL);
+  int error = __atomic_load_n(&el_snap.error, __ATOMIC_ACQUIRE);
+  if (error != 0) {
+    fprintf(stderr,"el_snapshot_restore_lazy: filling the heap failed: %s\n", strerror(error));
+  }
+  close(el_snap.uffd);
+  close(el_snap.fd);
+  free(el_snap.order);
+  free(el_snap.present);
+  el_snap.uffd = -1;
+  el_snap.fd = -1;
+  el_snap.order = NULL;
+  el_snap.present = NULL;
+  el_snap.active = 0;
+  return error != 0 ? -1 : 0;
+}
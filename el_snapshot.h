@@ -0,0 +1,45 @@
+#ifndef EL_SNAPSHOT_H
+#define EL_SNAPSHOT_H
+
+// Heap snapshots: the whole heap image along with the list metadata of
+// el_ctl is written to a file and can later be restored at the same
+// address, either all at once or lazily with userfaultfd.
+
+#include <stddef.h>
+#include "el_malloc.h"
+
+#define EL_SNAPSHOT_MAGIC "ELSNAP1"
+
+// Header at the start of a snapshot file. It is followed by npages page
+// numbers (size_t) giving the order in which pages should be prefetched
+// during a lazy restore and then, at data_offset which is page aligned,
+// by the heap image itself.
+typedef struct {
+  char magic[8];                // EL_SNAPSHOT_MAGIC
+  void *heap_start;             // address the heap must be restored to
+  size_t heap_bytes;            // size of the heap image
+  size_t page_size;             // page size of the saving process
+  size_t npages;                // pages in the heap image
+  size_t data_offset;           // file offset of the heap image
+  el_blockhead_t *avail_first;  // first/last blocks of the available list; NULL if empty
+  el_blockhead_t *avail_last;
+  size_t avail_length;
+  size_t avail_bytes;
+  size_t avail_pages;
+  el_blockhead_t *used_first;   // first/last blocks of the used list; NULL if empty
+  el_blockhead_t *used_last;
+  size_t used_length;
+  size_t used_bytes;
+  size_t used_pages;
+  size_t purged_pages;          // page accounting of el_ctl when saved
+  char fit;                     // options in effect when saved
+  size_t split_min;
+} el_snapshot_header_t;
+
+// functions defined in el_snapshot.c
+int el_snapshot_save(const char *path);
+int el_snapshot_restore(const char *path);
+int el_snapshot_restore_lazy(const char *path);
+int el_snapshot_wait();
+
+#endif // EL_SNAPSHOT_H
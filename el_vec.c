@@ -0,0 +1,155 @@
+// el_vec.c: growable array exploiting in-place expansion of el blocks.
+
+#define _GNU_SOURCE             // for mremap()
+#include <string.h>
+#include <sys/mman.h>
+#include "el_malloc.h"
+#include "el_vec.h"
+
+// Address at which the next array mapping is placed. Mappings are laid
+// out one after another from EL_VEC_MAP_START_ADDRESS so, like the heap,
+// they land at the same addresses on every run doing the same work.
+static char *next_map = EL_VEC_MAP_START_ADDRESS;
+
+// Round the mapping size for nbytes up to whole pages
+static size_t map_bytes(size_t nbytes) {
+  return (nbytes + EL_PAGE_SIZE - 1) / EL_PAGE_SIZE * EL_PAGE_SIZE;
+}
+
+// Map nbytes, a multiple of the page size, at the next fixed address or
+// wherever the kernel likes if something else already occupies it
+static void *map_next(size_t nbytes) {
+  void *data = mmap(next_map, nbytes, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+  if (data == next_map) {
+    next_map += nbytes;
+    return data;
+  }
+  if (data != MAP_FAILED) {     // kernels before 4.17 treat the address as a hint
+    munmap(data, nbytes);
+  }
+  return mmap(NULL, nbytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+}
+
+// Initialize vec to be empty holding elements of elem bytes
+void el_vec_init(el_vec_t *vec, size_t elem) {
+  vec->data = NULL;
+  vec->len = 0;
+  vec->cap = 0;
+  vec->elem = elem;
+  vec->mapped = 0;
+  vec->map_len = 0;
+  vec->copied = 0;
+}
+
+// Make room for at least n elements in vec. Capacity grows geometrically
+// and afterwards reflects all usable space of the block, which may be
+// more than asked for. Returns 0 on success and -1 if no memory is
+// available in which case vec is unchanged.
+int el_vec_reserve(el_vec_t *vec, size_t n) {
+  if (n <= vec->cap) {
+    return 0;
+  }
+  size_t need = n * vec->elem;
+  size_t want = 2 * vec->cap * vec->elem;
+  want = want > need ? want : need;
+  want = want > EL_VEC_MIN_BYTES ? want : EL_VEC_MIN_BYTES;
+
+  if (vec->mapped) {
+    // pages are moved by the kernel, never copied; grow in place if the
+    // next mapping leaves room, otherwise move onto a fresh placement
+    size_t old_bytes = vec->map_len;
+    void *data = mremap(vec->data, old_bytes, map_bytes(want), 0);
+    if (data != MAP_FAILED) {
+      // the last placement grew over next_map which must move past it
+      char *end = (char *) data + map_bytes(want);
+      if ((char *) data < next_map && end > next_map) {
+        next_map = end;
+      }
+    } else {
+      void *dst = map_next(map_bytes(want));
+      if (dst == MAP_FAILED) {
+        return -1;
+      }
+      data = mremap(vec->data, old_bytes, map_bytes(want),
+                    MREMAP_MAYMOVE | MREMAP_FIXED, dst);
+      if (data == MAP_FAILED) {
+        munmap(dst, map_bytes(want));
+        return -1;
+      }
+    }
+    vec->data = data;
+    vec->map_len = map_bytes(want);
+    vec->cap = vec->map_len / vec->elem;
+    return 0;
+  }
+
+  if (want >= EL_VEC_MAP_THRESHOLD) {
+    // large arrays get their own mapping; this is the last copy made
+    void *data = map_next(map_bytes(want));
+    if (data == MAP_FAILED) {
+      return -1;
+    }
+    if (vec->data != NULL) {
+      memcpy(data, vec->data, vec->len * vec->elem);
+      vec->copied += vec->len * vec->elem;
+      el_free(vec->data);
+    }
+    vec->data = data;
+    vec->mapped = 1;
+    vec->map_len = map_bytes(want);
+    vec->cap = vec->map_len / vec->elem;
+    return 0;
+  }
+
+  if (vec->data == NULL) {
+    vec->data = el_malloc(want);
+    if (vec->data == NULL) {
+      return -1;
+    }
+  } else if (el_expand(vec->data, want) != 0 && el_expand(vec->data, need) != 0) {
+    void *data = el_malloc(want);
+    if (data == NULL) {
+      return -1;
+    }
+    memcpy(data, vec->data, vec->len * vec->elem);
+    vec->copied += vec->len * vec->elem;
+    el_free(vec->data);
+    vec->data = data;
+  }
+  vec->cap = el_usable_size(vec->data) / vec->elem;
+  return 0;
+}
+
+// Append a copy of the element at elem to the end of vec. Returns a
+// pointer to the stored element or NULL if no memory is available.
+void *el_vec_push(el_vec_t *vec, const void *elem) {
+  if (vec->len == vec->cap && el_vec_reserve(vec, vec->len + 1) != 0) {
+    return NULL;
+  }
+  void *dst = PTR_PLUS_BYTES(vec->data, vec->len * vec->elem);
+  memcpy(dst, elem, vec->elem);
+  vec->len++;
+  return dst;
+}
+
+// Append copies of the n elements at elems to the end of vec. Returns 0
+// on success and -1 if no memory is available.
+int el_vec_append(el_vec_t *vec, const void *elems, size_t n) {
+  if (el_vec_reserve(vec, vec->len + n) != 0) {
+    return -1;
+  }
+  memcpy(PTR_PLUS_BYTES(vec->data, vec->len * vec->elem), elems, n * vec->elem);
+  vec->len += n;
+  return 0;
+}
+
+// Release the memory of vec and leave it empty
+void el_vec_free(el_vec_t *vec) {
+  if (vec->mapped) {
+    munmap(vec->data, vec->map_len);
+  } else if (vec->data != NULL) {
+    el_free(vec->data);
+  }
+  el_vec_init(vec, vec->elem);
+}
@@ -0,0 +1,41 @@
+#ifndef EL_VEC_H
+#define EL_VEC_H
+
+// Growable array of fixed size elements on top of el_malloc(). Growth
+// first tries to expand the block in place with el_expand() which
+// absorbs the available block above it, so appends rarely copy. Arrays
+// of at least EL_VEC_MAP_THRESHOLD bytes move to a mapping of their own
+// which grows with mremap() and never copies either.
+
+#include <stddef.h>
+
+// arrays at least this large are kept in their own mapping
+#define EL_VEC_MAP_THRESHOLD ((size_t) 256 * 1024)
+
+// fixed address from which array mappings are placed, well above the heap
+#define EL_VEC_MAP_START_ADDRESS ((void *) 0x0000610000000000)
+
+// capacity reserved by the first append in bytes
+#define EL_VEC_MIN_BYTES     ((size_t) 64)
+
+typedef struct {
+  void *data;                   // elements; NULL until the first append
+  size_t len;                   // number of elements in use
+  size_t cap;                   // number of elements that fit in data
+  size_t elem;                  // size of one element in bytes
+  int mapped;                   // 1 if data is a mapping of its own, 0 if an el block
+  size_t map_len;               // bytes of the mapping at data if mapped
+  size_t copied;                // bytes copied by growth over the life of the array
+} el_vec_t;
+
+// pointer to element i of vec cast to type
+#define EL_VEC_AT(vec, type, i) (((type *) (vec)->data) + (i))
+
+// functions defined in el_vec.c
+void el_vec_init(el_vec_t *vec, size_t elem);
+int el_vec_reserve(el_vec_t *vec, size_t n);
+void *el_vec_push(el_vec_t *vec, const void *elem);
+int el_vec_append(el_vec_t *vec, const void *elems, size_t n);
+void el_vec_free(el_vec_t *vec);
+
+#endif // EL_VEC_H
@@ -1,15 +1,139 @@
 // el_malloc.c test program
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "el_malloc.h"
+#include "el_snapshot.h"
+#include "el_vec.h"
+#include "el_iobuf.h"
+#include "el_slab.h"
+#include "el_shadow.h"
 
 #define HEAP_SIZE 1024
 
 #define PRINT_TEST sprintf(sysbuf,"awk 'NR==(%d+1) {P=1;print \"{\"} P==1 && /ENDTEST/{P=0; print \"}\"} P==1{print}' %s", __LINE__, __FILE__); \
     system(sysbuf);
 
+// object type for the object cache test
+typedef struct {
+    int magic;                  // set by the constructor
+    int uses;                   // bumped by each user, kept while cached
+} test_obj_t;
+
+int test_obj_ctors = 0, test_obj_dtors = 0;
+
+void test_obj_ctor(void *obj) {
+    ((test_obj_t *) obj)->magic = 0x51AB;
+    ((test_obj_t *) obj)->uses = 0;
+    test_obj_ctors++;
+}
+
+void test_obj_dtor(void *obj) {
+    ((test_obj_t *) obj)->magic = 0;
+    test_obj_dtors++;
+}
+
+// frees the block at arg after a short delay, for the budget test
+void *delayed_free(void *arg) {
+    usleep(20000);
+    el_free(arg);
+    return NULL;
+}
+
+// hooks for the event hook test printing heap offsets
+void hook_malloc(void *ptr, size_t nbytes, void *arg) {
+    printf("%s malloc %lu -> %ld\n", (char *) arg, nbytes, PTR_MINUS_PTR(ptr, el_ctl.heap_start));
+}
+
+void hook_free(void *ptr, void *arg) {
+    printf("%s free %ld\n", (char *) arg, PTR_MINUS_PTR(ptr, el_ctl.heap_start));
+}
+
+void hook_realloc(void *old_ptr, void *new_ptr, size_t nbytes, void *arg) {
+    printf("%s realloc %ld %lu -> %ld\n", (char *) arg, PTR_MINUS_PTR(old_ptr, el_ctl.heap_start),
+           nbytes, PTR_MINUS_PTR(new_ptr, el_ctl.heap_start));
+}
+
+// counts the frees reported to it in the int at arg
+void hook_count_free(void *ptr, void *arg) {
+    (*(int *) arg)++;
+}
+
+// takes and drops references to arg many times, for the refcount test
+void *retain_release(void *arg) {
+    for (int i = 0; i < 100000; i++) {
+        el_retain(arg);
+        el_release(arg);
+    }
+    return NULL;
+}
+
+// 1 if the mapping holding addr is offered to KSM ("mg" in its VmFlags
+// in /proc/self/smaps), 0 if not and -1 if it can not be found
+int page_mergeable(void *addr) {
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (f == NULL) {
+        return -1;
+    }
+    char line[512];
+    int found = 0, ret = -1;
+    while (ret == -1 && fgets(line, sizeof(line), f) != NULL) {
+        unsigned long lo, hi;
+        if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+            found = (unsigned long) addr >= lo && (unsigned long) addr < hi;
+        } else if (found && strncmp(line, "VmFlags:", 8) == 0) {
+            ret = strstr(line, " mg") != NULL;
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+// random malloc/free on the shared heap from several threads, and a
+// counter bumped under a lock of its own, for the lock test
+#define LOCK_TEST_OPS 20000
+
+el_lock_t counter_lock;
+long counter = 0;
+
+void *lock_worker(void *arg) {
+    unsigned long rng = (unsigned long) arg * 2654435761UL + 1;
+    void *slots[8] = {};
+    for (int i = 0; i < LOCK_TEST_OPS; i++) {
+        rng = rng * 6364136223846793005UL + 1442695040888963407UL;
+        int k = (rng >> 33) % 8;
+        if (slots[k] == NULL) {
+            slots[k] = el_malloc(16 + (rng >> 40) % 100);
+        } else {
+            el_free(slots[k]);
+            slots[k] = NULL;
+        }
+        el_lock(&counter_lock);
+        counter++;
+        el_unlock(&counter_lock);
+    }
+    for (int k = 0; k < 8; k++) {
+        if (slots[k] != NULL) {
+            el_free(slots[k]);
+        }
+    }
+    return NULL;
+}
+
+// slots taken by the signal handler of the signal pool test
+void *sig_ptrs[4];
+
+void sig_handler(int sig) {
+    for (int i = 0; i < 4; i++) {
+        sig_ptrs[i] = el_sig_malloc(100);
+    }
+}
+
 void print_ptr(char *str, void *ptr) {
     if (ptr == NULL) {
         printf("%s: (nil)\n", str);
@@ -509,6 +633,893 @@ int main(int argc, char *argv[]) {
         print_ptrs(ptr, len);
     } // ENDTEST
 
+    else if (strcmp(test_name, "Snapshot Restore") == 0) {
+        PRINT_TEST;
+        // Saves a heap with used and available blocks to a snapshot,
+        // tears it down and restores it lazily. The restored heap should
+        // print identically and keep allocating/freeing/merging correctly.
+        // Options not kept in the snapshot must not carry over.
+
+        void *ptr[16] = {};
+        int len = 0;
+
+        ptr[len++] = el_malloc(128);
+        ptr[len++] = el_malloc(200);
+        ptr[len++] = el_malloc(64);
+        el_free(ptr[1]);
+        ptr[1] = NULL;
+        strcpy(ptr[0], "saved data");
+        printf("BEFORE SAVE\n");
+        el_print_stats();
+        printf("\n");
+
+        char path[] = "/tmp/test_el_snapshot_XXXXXX";
+        close(mkstemp(path));
+        el_set_conf("budget:100000,grow:on");
+        int ret = el_snapshot_save(path);
+        printf("save: %d\n", ret);
+        el_cleanup();
+
+        ret = el_snapshot_restore_lazy(path);
+        printf("restore ok: %d\n", ret >= 0);
+        printf("budget: %lu  grow: %d\n", el_ctl.budget, el_ctl.grow);
+        printf("AFTER RESTORE\n");
+        el_print_stats();
+        printf("\n");
+        printf("ptr[0] contains: %s\n", (char *) ptr[0]);
+
+        ptr[len++] = el_malloc(100);
+        el_free(ptr[0]);
+        el_free(ptr[2]);
+        printf("\nMALLOC 3, FREE 0,2\n");
+        el_print_stats();
+        printf("\n");
+        printf("POINTERS\n");
+        print_ptrs(ptr, len);
+
+        printf("wait: %d\n", el_snapshot_wait());
+        unlink(path);
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Realloc In Place") == 0) {
+        PRINT_TEST;
+        // Grows a block with el_realloc(). While the block above it is
+        // available the block should grow in place absorbing part of it;
+        // once a used block sits above, the contents must move.
+
+        void *ptr[16] = {};
+        int len = 0;
+
+        ptr[len++] = el_malloc(64);
+        strcpy(ptr[0], "contents");
+        void *grown = el_realloc(ptr[0], 300);
+        printf("\nREALLOC 0 TO 300\n");
+        el_print_stats();
+        printf("\n");
+        printf("in place: %d  usable: %lu\n", grown == ptr[0], el_usable_size(grown));
+
+        ptr[len++] = el_malloc(100);
+        void *moved = el_realloc(grown, 600);
+        printf("\nMALLOC 1, REALLOC 0 TO 600\n");
+        el_print_stats();
+        printf("\n");
+        printf("in place: %d  usable: %lu  contents: %s\n",
+               moved == grown, el_usable_size(moved), (char *) moved);
+        ptr[0] = moved;
+        printf("POINTERS\n");
+        print_ptrs(ptr, len);
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Vec Growth") == 0) {
+        PRINT_TEST;
+        // Appends to an el_vec one element at a time. With nothing
+        // allocated above it the array should grow in place every time
+        // and never copy its contents.
+
+        el_vec_t vec;
+        el_vec_init(&vec, sizeof(int));
+        for (int i = 0; i < 800; i++) {
+            el_vec_push(&vec, &i);
+        }
+        long sum = 0;
+        for (int i = 0; i < vec.len; i++) {
+            sum += *EL_VEC_AT(&vec, int, i);
+        }
+        printf("len: %lu  cap: %lu  sum: %ld  copied: %lu\n",
+               vec.len, vec.cap, sum, vec.copied);
+        el_print_stats();
+        printf("\n");
+
+        el_vec_free(&vec);
+        printf("FREED\n");
+        el_print_stats();
+        printf("\n");
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Iobuf Chain") == 0) {
+        PRINT_TEST;
+        // Builds a response in an el_iobuf chain by appending body data,
+        // referencing a static trailer and prepending headers. The iovec
+        // export should give the fragments in order and releasing the
+        // chain should give all segments back to the heap.
+
+        static char trailer[] = "-- end --\n";
+        el_iobuf_t buf;
+        el_iobuf_init(&buf);
+        el_iobuf_append(&buf, "body line 1\n", 12);
+        el_iobuf_append(&buf, "body line 2\n", 12);
+        el_iobuf_append_ref(&buf, trailer, strlen(trailer));
+        el_iobuf_prepend(&buf, "\n", 1);
+        el_iobuf_prepend(&buf, "Content-Type: text/plain\n", 25);
+        printf("segments: %lu  bytes: %lu\n", buf.nsegs, buf.bytes);
+        el_print_stats();
+        printf("\n");
+
+        struct iovec iov[8];
+        int n = el_iobuf_to_iovec(&buf, iov, 8);
+        printf("IOVEC (%d entries)\n", n);
+        fflush(stdout);
+        writev(STDOUT_FILENO, iov, n);
+
+        el_iobuf_release(&buf);
+        printf("\nRELEASED\n");
+        el_print_stats();
+        printf("\n");
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Thread Byte Counters") == 0) {
+        PRINT_TEST;
+        // Reads the per-thread allocated/deallocated counters around a
+        // few allocations, an in-place realloc and frees. The differences
+        // should be the usable bytes of the blocks involved.
+
+        size_t *allocp = el_thread_allocatedp();
+        size_t *deallocp = el_thread_deallocatedp();
+        size_t alloc0 = *allocp;
+        size_t dealloc0 = *deallocp;
+
+        void *p0 = el_malloc(128);
+        void *p1 = el_malloc(64);
+        printf("after malloc 128, 64:   allocated %lu  deallocated %lu\n",
+               *allocp - alloc0, *deallocp - dealloc0);
+
+        p1 = el_realloc(p1, 200);
+        printf("after realloc 64->200:  allocated %lu  deallocated %lu\n",
+               *allocp - alloc0, *deallocp - dealloc0);
+
+        el_free(p0);
+        el_free(p1);
+        printf("after free both:        allocated %lu  deallocated %lu\n",
+               *allocp - alloc0, *deallocp - dealloc0);
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Buffer Heap") == 0) {
+        PRINT_TEST;
+        // Runs the allocator over a static array instead of a mapped heap.
+        // The heap starts at the array and el_cleanup() must leave the
+        // array intact.
+
+        static char buffer[1024] __attribute__((aligned(16)));
+        el_cleanup();           // release the heap mapped by el_init()
+        int ret = el_init_with_buffer(buffer, sizeof(buffer));
+        printf("ret: %d\n", ret);
+        printf("heap in buffer: %d\n", el_ctl.heap_start == (void *) buffer);
+        printf("heap_bytes: %lu\n", el_ctl.heap_bytes);
+
+        char *p0 = el_malloc(200);
+        char *p1 = el_malloc(300);
+        char *p2 = el_malloc(600);
+        printf("p0 offset: %ld\n", PTR_MINUS_PTR(p0, buffer));
+        printf("p1 offset: %ld\n", PTR_MINUS_PTR(p1, buffer));
+        printf("p2: %p\n", p2);
+        strcpy(p1, "still here");
+        el_free(p0);
+        printf("avail: %lu blocks %lu bytes  used: %lu blocks %lu bytes\n",
+               el_ctl.avail->length, el_ctl.avail->bytes,
+               el_ctl.used->length, el_ctl.used->bytes);
+
+        el_cleanup();
+        printf("after cleanup: %s\n", buffer + PTR_MINUS_PTR(p1, buffer));
+        el_init();              // for the test harness cleanup
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Sub-heap") == 0) {
+        PRINT_TEST;
+        // Carves a sub-heap from a block of the main heap, allocates from
+        // it and a sub-heap nested inside it, then destroys the sub-heap
+        // which should return its one block to the main heap.
+
+        void *p0 = el_malloc(128);
+        el_ctl_t *sub = el_subheap_create(&el_ctl, 2048);
+        printf("sub in main heap: %d\n",
+               (void *) sub > el_ctl.heap_start && (void *) sub < el_ctl.heap_end);
+        printf("main used: %lu blocks\n", el_ctl.used->length);
+
+        void *s0 = el_heap_malloc(sub, 100);
+        void *s1 = el_heap_malloc(sub, 200);
+        el_ctl_t *nested = el_subheap_create(sub, 256);
+        void *n0 = el_heap_malloc(nested, 64);
+        printf("s0 offset: %ld\n", PTR_MINUS_PTR(s0, sub->heap_start));
+        printf("s1 offset: %ld\n", PTR_MINUS_PTR(s1, sub->heap_start));
+        printf("n0 offset: %ld\n", PTR_MINUS_PTR(n0, nested->heap_start));
+        printf("too big: %p\n", el_heap_malloc(sub, 2048));
+        el_heap_free(sub, s0);
+        // control blocks and heap starts are aligned for the heap lock
+        printf("aligned: %d %d %d %d\n",
+               (size_t) sub % EL_ALIGN == 0, (size_t) nested % EL_ALIGN == 0,
+               (size_t) sub->heap_start % EL_ALIGN == 0,
+               (size_t) nested->heap_start % EL_ALIGN == 0);
+        // the nested sub-heap's block includes an aligned el_ctl_t
+        printf("sub avail: %lu blocks %lu bytes  used: %lu blocks %lu bytes + el_ctl_t\n",
+               sub->avail->length, sub->avail->bytes + EL_ALIGN_UP(sizeof(el_ctl_t)),
+               sub->used->length, sub->used->bytes - EL_ALIGN_UP(sizeof(el_ctl_t)));
+        printf("main used: %lu blocks\n", el_ctl.used->length);
+
+        el_subheap_destroy(sub);
+        el_free(p0);
+        el_print_stats();
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Allocation Scope") == 0) {
+        PRINT_TEST;
+        // Allocates inside an aborted and a committed scope. Abort should
+        // free only the blocks allocated in the scope and still live;
+        // commit should keep them.
+
+        void *keep = el_malloc(100);
+        printf("begin: %d\n", el_txn_begin());
+        printf("nested begin: %d\n", el_txn_begin());
+        void *p0 = el_malloc(200);
+        void *p1 = el_malloc(300);
+        el_malloc(50);
+        el_free(p0);
+        keep = el_realloc(keep, 400);   // moves, logged at its new address
+        p1 = el_realloc(p1, 350);       // grows in place
+        printf("used before abort: %lu blocks\n", el_ctl.used->length);
+        el_txn_abort();
+        printf("used after abort:  %lu blocks\n", el_ctl.used->length);
+
+        keep = el_malloc(100);
+        el_txn_begin();
+        el_malloc(200);
+        el_malloc(300);
+        el_txn_commit();
+        printf("used after commit: %lu blocks\n", el_ctl.used->length);
+        el_txn_abort();         // no scope open, nothing logged
+        printf("used after abort:  %lu blocks\n", el_ctl.used->length);
+        el_print_stats();
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Vec Fixed Mapping") == 0) {
+        PRINT_TEST;
+        // Reserves an array past EL_VEC_MAP_THRESHOLD and grows it some
+        // more. Its mapping should start at EL_VEC_MAP_START_ADDRESS and
+        // stay there as nothing else is mapped above it. A second array
+        // must then be placed right after the grown mapping.
+
+        el_vec_t vec;
+        el_vec_init(&vec, sizeof(long));
+        el_vec_reserve(&vec, 40000);
+        printf("mapped: %d  fixed: %d\n", vec.mapped,
+               vec.data == EL_VEC_MAP_START_ADDRESS);
+        for (long i = 0; i < 100000; i++) {
+            el_vec_push(&vec, &i);
+        }
+        long sum = 0;
+        for (long i = 0; i < vec.len; i++) {
+            sum += *EL_VEC_AT(&vec, long, i);
+        }
+        printf("len: %lu  sum: %ld  fixed: %d\n", vec.len, sum,
+               vec.data == EL_VEC_MAP_START_ADDRESS);
+        printf("map_len: %lu\n", vec.map_len);
+        el_vec_t next;
+        el_vec_init(&next, sizeof(long));
+        el_vec_reserve(&next, 40000);
+        printf("next fixed after first: %d\n",
+               next.data == PTR_PLUS_BYTES(vec.data, vec.map_len));
+        el_vec_free(&next);
+        el_vec_free(&vec);
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Size-class Cache") == 0) {
+        PRINT_TEST;
+        // Enables the size-class cache. Freed small blocks should stay in
+        // the used list marked as cached and be handed out again to
+        // allocations of their class; flushing should coalesce them.
+
+        el_set_conf("cache:256");
+        void *p0 = el_malloc(100);
+        void *p1 = el_malloc(200);
+        void *p2 = el_malloc(1000);
+        el_free(p0);
+        el_free(p1);
+        el_free(p2);            // too large for the cache
+        el_print_stats();
+
+        void *p3 = el_malloc(90);       // same class as p0
+        void *p4 = el_malloc(150);      // no cached block of its class
+        printf("p3 == p0: %d\n", p3 == p0);
+        printf("p4 == p1: %d\n", p4 == p1);
+        el_free(p3);
+        el_free(p4);
+
+        printf("flushed: %lu\n", el_cache_flush());
+        el_print_stats();
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Object Cache") == 0) {
+        PRINT_TEST;
+        // Allocates objects from a cache, frees and reallocates them.
+        // Reused objects should keep the state their last user left and
+        // the constructor should run once per object of a slab; the
+        // destructor only when the empty slab is reaped.
+
+        el_objcache_t *cache = el_objcache_create(sizeof(test_obj_t), test_obj_ctor, test_obj_dtor);
+        printf("per_slab: %lu\n", cache->per_slab);
+        test_obj_t *objs[3];
+        for (int i = 0; i < 3; i++) {
+            objs[i] = el_objcache_alloc(cache);
+            objs[i]->uses++;
+        }
+        printf("slabs: %lu  ctors: %d  dtors: %d\n", cache->slabs, test_obj_ctors, test_obj_dtors);
+        printf("aligned: %d %d %d\n", (size_t) &cache->lock % _Alignof(el_lock_t) == 0,
+               (size_t) objs[0] % EL_ALIGN == 0, (size_t) objs[1] % EL_ALIGN == 0);
+        for (int i = 0; i < 3; i++) {
+            el_objcache_free(cache, objs[i]);
+        }
+        for (int i = 0; i < 3; i++) {
+            objs[i] = el_objcache_alloc(cache);
+            printf("obj %d: magic %x  uses %d\n", i, objs[i]->magic, objs[i]->uses);
+        }
+        printf("slabs: %lu  ctors: %d  dtors: %d\n", cache->slabs, test_obj_ctors, test_obj_dtors);
+        printf("reaped while in use: %lu\n", el_objcache_reap(cache));
+        for (int i = 0; i < 3; i++) {
+            el_objcache_free(cache, objs[i]);
+        }
+        printf("reaped when empty: %lu\n", el_objcache_reap(cache));
+        printf("slabs: %lu  ctors: %d  dtors: %d\n", cache->slabs, test_obj_ctors, test_obj_dtors);
+        el_objcache_destroy(cache);
+        el_print_stats();
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Heap Growth") == 0) {
+        PRINT_TEST;
+        // Allocations larger than the heap fail until growth is turned
+        // on; then the heap grows in place and the new pages merge with
+        // the available block at the top. el_grow() adds prefaulted pages
+        // ahead of demand.
+
+        void *p0 = el_malloc(1000);
+        print_ptr("too big", el_malloc(6000));
+        printf("el_grow while off: %d\n", el_grow(8192, 1));
+        el_set_conf("grow:on");
+        void *p1 = el_malloc(6000);
+        printf("p1 offset: %ld\n", PTR_MINUS_PTR(p1, el_ctl.heap_start));
+        printf("heap_bytes: %lu\n", el_ctl.heap_bytes);
+        printf("el_grow: %d\n", el_grow(100000, 1));
+        printf("heap_bytes: %lu\n", el_ctl.heap_bytes);
+        el_free(p0);
+        el_free(p1);
+        printf("avail: %lu blocks %lu bytes  used: %lu blocks\n",
+               el_ctl.avail->length, el_ctl.avail->bytes, el_ctl.used->length);
+        el_page_stats_t stats;
+        el_get_page_stats(&stats);
+        printf("pages: %lu  purged: %lu\n", stats.pages, stats.purged);
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Allocation Budget") == 0) {
+        PRINT_TEST;
+        // Sets a budget of used bytes. An allocation over budget fails;
+        // el_malloc_wait() times out while nothing is freed and succeeds
+        // once another thread frees enough.
+
+        el_set_conf("budget:1500");
+        void *p0 = el_malloc(600);
+        void *p1 = el_malloc(600);
+        print_ptr("over budget", el_malloc(600));
+        print_ptr("wait 1ms", el_malloc_wait(600, 1000000));
+        pthread_t thread;
+        pthread_create(&thread, NULL, delayed_free, p1);
+        void *p2 = el_malloc_wait(600, 1000000000);
+        pthread_join(thread, NULL);
+        printf("wait 1s got p1's block: %d\n", p2 == p1);
+        printf("used: %lu bytes  waiters: %p\n", el_ctl.used->bytes, el_ctl.waiters);
+        el_free(p0);
+        el_free(p2);
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Reserve Commit") == 0) {
+        PRINT_TEST;
+        // Reserves large buffers and commits them to what was used. The
+        // tail of each should go back to the available list, merging with
+        // the free space above, while the data stays where it is.
+
+        char *p0 = el_reserve(1500);
+        strcpy(p0, "header line");
+        printf("committed: %lu\n", el_commit(p0, 100));
+        printf("p0: %s\n", p0);
+        char *p1 = el_reserve(2000);
+        char *p2 = el_reserve(500);
+        printf("committed: %lu\n", el_commit(p1, 1990));     // tail too small to split
+        printf("committed: %lu\n", el_commit(p1, 300));
+        el_print_stats();
+        el_free(p0);
+        el_free(p1);
+        el_free(p2);
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Event Hooks") == 0) {
+        PRINT_TEST;
+        // Installs hooks printing each event, runs a few operations and
+        // removes the hooks. Events after removal should not be seen.
+
+        el_hooks_t hooks = {hook_malloc, hook_free, hook_realloc, "hook:"};
+        printf("set: %d\n", el_set_hooks(&hooks));
+        void *p0 = el_malloc(100);
+        void *p1 = el_malloc(200);
+        p0 = el_realloc(p0, 300);       // moves above p1
+        p1 = el_realloc(p1, 250);       // moves too, p0 is above it
+        el_free(p0);
+        void *batch[2] = {p1, el_malloc(50)};
+        el_free_batch(batch, 2);
+        printf("set: %d\n", el_set_hooks(NULL));
+        el_free(el_malloc(10));
+        printf("done\n");
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Hooks Double Free") == 0) {
+        PRINT_TEST;
+        // Frees blocks twice through el_free(), el_free_batch() and the
+        // size-class cache. The free hook should see each block once as
+        // the second free is ignored.
+
+        int frees = 0;
+        el_hooks_t hooks = {NULL, hook_count_free, NULL, &frees};
+        el_set_hooks(&hooks);
+        void *p0 = el_malloc(100);
+        el_free(p0);
+        el_free(p0);
+        printf("el_free: %d\n", frees);
+
+        frees = 0;
+        void *p1 = el_malloc(100);
+        void *batch[3] = {p1, p1, NULL};
+        el_free_batch(batch, 3);
+        printf("el_free_batch: %d\n", frees);
+
+        frees = 0;
+        el_set_conf("cache:256");
+        void *p2 = el_malloc(100);
+        el_free(p2);
+        el_free(p2);
+        printf("cached: %d\n", frees);
+        el_set_hooks(NULL);
+        el_cache_flush();
+        el_print_stats();
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Signal Pool") == 0) {
+        PRINT_TEST;
+        // Allocates from the signal pool inside a signal handler, then
+        // drains the pool and frees it again. The main heap lists should
+        // not change at any point.
+
+        void *p0 = el_malloc(100);
+        signal(SIGUSR1, sig_handler);
+        raise(SIGUSR1);
+        for (int i = 0; i < 4; i++) {
+            printf("sig_ptrs[%d]: slot %ld\n", i, PTR_MINUS_PTR(sig_ptrs[i], sig_ptrs[0]) / (long) EL_SIG_SLOT_BYTES);
+        }
+        el_sig_free(sig_ptrs[1]);
+        void *again = el_sig_malloc(EL_SIG_SLOT_BYTES);
+        printf("reused slot 1: %d\n", again == sig_ptrs[1]);
+        print_ptr("too large", el_sig_malloc(EL_SIG_SLOT_BYTES + 1));
+        void *all[EL_SIG_SLOTS];
+        int n = 0;
+        while ((all[n] = el_sig_malloc(8)) != NULL) {
+            n++;
+        }
+        printf("more slots taken: %d\n", n);
+        el_print_sig_stats();
+        for (int i = 0; i < n; i++) {
+            el_sig_free(all[i]);
+        }
+        for (int i = 0; i < 4; i++) {
+            el_sig_free(sig_ptrs[i]);
+        }
+        el_sig_free(NULL);
+        el_sig_free(p0);                // not from the pool, ignored
+        el_print_sig_stats();
+        el_print_stats();
+        el_free(p0);
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Reference Counting") == 0) {
+        PRINT_TEST;
+        // Shares a buffer through counted references. Threads retaining
+        // and releasing at once should leave the count as it was; the
+        // last release should free the block and merge it back.
+
+        char *buf = el_malloc_rc(100);
+        strcpy(buf, "shared");
+        el_blockhead_t *head = PTR_MINUS_BYTES(buf, sizeof(el_blockhead_t));
+        printf("refs: %u\n", head->refs);
+        printf("same: %d\n", el_retain(buf) == buf);
+        el_retain(buf);
+        printf("refs: %u\n", head->refs);
+
+        pthread_t threads[4];
+        for (int i = 0; i < 4; i++) {
+            pthread_create(&threads[i], NULL, retain_release, buf);
+        }
+        for (int i = 0; i < 4; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        printf("refs after threads: %u  data: %s\n", head->refs, buf);
+
+        printf("left: %u\n", el_release(buf));
+        printf("left: %u\n", el_release(buf));
+        el_print_stats();
+        printf("left: %u\n", el_release(buf));
+        el_print_stats();
+
+        // counted blocks are aligned after an odd sized one, are not
+        // moved by el_realloc() and ignore releases without references
+        void *odd = el_malloc(3);
+        char *rc = el_malloc_rc(10);
+        void *wall = el_malloc(10);
+        head = PTR_MINUS_BYTES(rc, sizeof(el_blockhead_t));
+        printf("aligned: %d %d\n", (size_t) rc % EL_ALIGN == 0,
+               (size_t) &head->refs % _Alignof(unsigned int) == 0);
+        printf("moved: %p  refs: %u\n", el_realloc(rc, 500), head->refs);
+        printf("left: %u\n", el_release(wall));
+        printf("left: %u\n", el_release(rc));
+        printf("left: %u\n", el_release(rc));
+        el_free(wall);
+        el_free(odd);
+        el_print_stats();
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Mergeable Heap") == 0) {
+        PRINT_TEST;
+        // Offers the heap to KSM and reads back its page sharing. A
+        // sub-heap too small to hold a whole page has nothing to offer.
+        // Whether KSM merges anything depends on the host so only the
+        // consistency of the counts is shown.
+
+        el_ksm_stats_t stats;
+        el_ctl_t *sub = el_subheap_create(&el_ctl, 2048);
+        int ret = el_heap_set_mergeable(sub);
+        printf("sub set: %d  mergeable: %d\n", ret, sub->mergeable);
+        ret = el_heap_get_ksm_stats(sub, &stats);
+        printf("sub get: %d  pages: %lu  resident: %lu\n", ret, stats.pages, stats.resident);
+        el_subheap_destroy(sub);
+
+        ret = el_heap_get_ksm_stats(&el_ctl, &stats);
+        printf("get: %d  pages: %lu  mergeable: %d\n", ret, stats.pages, el_ctl.mergeable);
+        ret = el_heap_set_mergeable(&el_ctl);
+        printf("set: %d  mergeable: %d\n", ret, el_ctl.mergeable);
+        char *p0 = el_malloc(2000);
+        memset(p0, 'x', 2000);
+        ret = el_heap_get_ksm_stats(&el_ctl, &stats);
+        printf("get: %d  pages: %lu  resident: %lu\n", ret, stats.pages, stats.resident);
+        printf("shared + unshared == resident: %d\n",
+               stats.shared + stats.unshared == stats.resident);
+        printf("process counts read: %d\n", stats.process_merging >= -1 && stats.process_profit >= -1);
+        el_free(p0);
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Mergeable Sub-heap Destroy") == 0) {
+        PRINT_TEST;
+        // Offers a sub-heap spanning whole pages to KSM and destroys it.
+        // Its pages go back to the parent which was never offered so
+        // they must be withdrawn from KSM again.
+
+        el_set_conf("grow:on");
+        el_ctl_t *sub = el_subheap_create(&el_ctl, 4 * EL_PAGE_SIZE);
+        void *page = (void *) (((size_t) sub->heap_start + EL_PAGE_SIZE - 1) /
+                               EL_PAGE_SIZE * EL_PAGE_SIZE);
+        printf("before: %d\n", page_mergeable(page));
+        printf("set: %d\n", el_heap_set_mergeable(sub));
+        printf("offered: %d\n", page_mergeable(page));
+        el_subheap_destroy(sub);
+        printf("after destroy: %d  parent: %d\n", page_mergeable(page), el_ctl.mergeable);
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Cold Hinting") == 0) {
+        PRINT_TEST;
+        // Marks a sub-heap cold and ticks it. Blocks spanning whole pages
+        // should be hinted once they reach EL_COLD_AGE ticks without a
+        // resize and again each EL_COLD_AGE ticks after; small and young
+        // blocks stay as they are. Data in hinted pages must survive.
+
+        static char buffer[65536] __attribute__((aligned(4096)));
+        el_cleanup();
+        el_init_with_buffer(buffer, sizeof(buffer));
+        printf("conf: %d\n", el_set_conf("cold:warm"));
+        printf("conf: %d\n", el_set_conf("cold:pageout"));
+        el_ctl_t *sub = el_subheap_create(&el_ctl, 40000);
+        printf("tick unmarked: %lu\n", el_heap_cold_tick(sub));
+        printf("mark: %d\n", el_heap_mark_cold(sub));
+        printf("mark: %d\n", el_heap_mark_cold(sub));
+
+        char *big = el_heap_malloc(sub, 10000);
+        char *small = el_heap_malloc(sub, 100);
+        char *grown = el_heap_malloc(sub, 9000);
+        memset(big, 'b', 10000);
+        strcpy(small, "small");
+        size_t hinted = 0;
+        for (int i = 0; i < EL_COLD_AGE - 1; i++) {
+            hinted += el_heap_cold_tick(sub);
+            if (i == EL_COLD_AGE / 2) {
+                el_heap_expand(sub, grown, 12000);      // resets its age
+            }
+        }
+        printf("hinted before age: %lu\n", hinted);
+        printf("hinted at age: %lu\n", el_heap_cold_tick(sub));
+        printf("hinted again: %lu\n", el_heap_cold_tick(sub));
+        el_heap_print_cold_stats(sub);
+        for (int i = 0; i < EL_COLD_AGE; i++) {
+            el_cold_tick();
+        }
+        el_heap_print_cold_stats(sub);
+        printf("data: %c%c %s\n", big[0], big[9999], small);
+
+        el_heap_free(sub, big);
+        el_heap_print_cold_stats(sub);
+        printf("start: %d\n", el_cold_start());
+        printf("start: %d\n", el_cold_start());
+        el_cold_stop();
+        el_subheap_destroy(sub);
+        el_heap_print_cold_stats(&el_ctl);
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Cold Nested Forget") == 0) {
+        PRINT_TEST;
+        // Marks a sub-heap nested in another cold and destroys the outer
+        // one. The nested heap goes with it so its mark must be dropped
+        // too, leaving room to mark EL_COLD_MAX_HEAPS new heaps.
+
+        static char buffer[65536] __attribute__((aligned(4096)));
+        el_cleanup();
+        el_init_with_buffer(buffer, sizeof(buffer));
+        el_ctl_t *outer = el_subheap_create(&el_ctl, 4096);
+        el_ctl_t *nested = el_subheap_create(outer, 1024);
+        printf("mark: %d\n", el_heap_mark_cold(nested));
+        el_subheap_destroy(outer);
+        el_ctl_t *subs[EL_COLD_MAX_HEAPS];
+        int marked = 0;
+        for (int i = 0; i < EL_COLD_MAX_HEAPS; i++) {
+            subs[i] = el_subheap_create(&el_ctl, 512);
+            marked += el_heap_mark_cold(subs[i]) == 0;
+        }
+        printf("marked: %d of %d\n", marked, EL_COLD_MAX_HEAPS);
+        printf("tick: %lu\n", el_cold_tick());
+        for (int i = 0; i < EL_COLD_MAX_HEAPS; i++) {
+            el_subheap_destroy(subs[i]);
+        }
+        printf("avail: %lu blocks  used: %lu blocks\n",
+               el_ctl.avail->length, el_ctl.used->length);
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Configuration") == 0) {
+        PRINT_TEST;
+        // Sets every option through el_set_conf() and checks malformed
+        // strings are rejected, then records a trace and prints it. An
+        // invalid free must not show up in the trace.
+
+        printf("ret: %d\n", el_set_conf("fit:best,split_min:64,cache:100,grow:on,budget:3000,cold:pageout"));
+        printf("fit: %c  split_min: %lu  cache_max: %lu  grow: %d  budget: %lu  pageout: %d\n",
+               el_ctl.fit, el_ctl.split_min, el_ctl.cache_max, el_ctl.grow, el_ctl.budget,
+               el_ctl.cold_advice == MADV_PAGEOUT);
+        printf("ret: %d\n", el_set_conf("cache:100000"));
+        printf("cache_max: %lu\n", el_ctl.cache_max);
+        printf("ret: %d\n", el_set_conf("fit:worst"));
+        printf("ret: %d\n", el_set_conf("split_min"));
+        printf("ret: %d\n", el_set_conf("fit:first,bogus:1,split_min:8"));
+        printf("fit: %c  split_min: %lu\n", el_ctl.fit, el_ctl.split_min);
+        printf("ret: %d\n", el_set_conf("trace:/nonexistent/dir/trace"));
+        printf("ret: %d\n", el_set_conf("split_min:0,cache:0,grow:off,budget:0,cold:cold"));
+
+        char path[] = "/tmp/el_trace_XXXXXX";
+        close(mkstemp(path));
+        char conf[64];
+        snprintf(conf, sizeof(conf), "trace:%s", path);
+        printf("ret: %d\n", el_set_conf(conf));
+        void *p0 = el_malloc(100);
+        void *p1 = el_malloc(50);
+        el_expand(p1, 80);
+        el_commit(p1, 20);
+        el_free(p0);
+        el_free(p0);                    // double free, ignored
+        el_free(p1);
+        fflush(el_ctl.trace);
+        FILE *f = fopen(path, "r");
+        char line[128];
+        while (fgets(line, sizeof(line), f) != NULL) {
+            printf("trace: %s", line);
+        }
+        fclose(f);
+        unlink(path);
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Page Accounting") == 0) {
+        PRINT_TEST;
+        // Grows the heap by untouched pages, dirties some through a
+        // large block, frees it and purges. The counted pages should
+        // agree with the pages mincore() finds resident at each step.
+
+        el_set_conf("grow:on");
+        printf("grow: %d\n", el_grow(EL_GROW_MIN_BYTES, 0));
+        el_print_page_stats();
+        char *p0 = el_malloc(20000);
+        char *p1 = el_malloc(100);
+        memset(p0, 'x', 20000);
+        printf("\nAFTER MALLOC\n");
+        el_print_page_stats();
+        el_free(p0);
+        printf("\nAFTER FREE\n");
+        el_print_page_stats();
+        printf("\npurged: %lu\n", el_purge());
+        printf("purged again: %lu\n", el_purge());
+        el_print_page_stats();
+        el_page_stats_t counted, audited;
+        el_get_page_stats(&counted);
+        printf("audit: %d\n", el_audit_pages(&audited));
+        printf("dirty agree: %d  purged agree: %d\n",
+               counted.dirty == audited.dirty, counted.purged == audited.purged);
+
+        // a sub-heap keeps counts of its own over its whole pages; its
+        // block starts out counted dirty until purged
+        el_ctl_t *sub = el_subheap_create(&el_ctl, 8 * EL_PAGE_SIZE);
+        printf("\nSUB-HEAP\n");
+        el_heap_print_page_stats(sub);
+        printf("purged: %lu\n", el_heap_purge(sub));
+        char *s0 = el_heap_malloc(sub, 3 * EL_PAGE_SIZE);
+        memset(s0, 'y', 3 * EL_PAGE_SIZE);
+        el_heap_print_page_stats(sub);
+        el_heap_free(sub, s0);
+        printf("purged: %lu\n", el_heap_purge(sub));
+        el_heap_get_page_stats(sub, &counted);
+        printf("audit: %d\n", el_heap_audit_pages(sub, &audited));
+        printf("pages agree: %d  dirty agree: %d  purged agree: %d\n",
+               counted.pages == audited.pages, counted.dirty == audited.dirty,
+               counted.purged == audited.purged);
+        el_subheap_destroy(sub);
+        el_free(p1);
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Heap Lock") == 0) {
+        PRINT_TEST;
+        // Counts uncontended acquisitions on one thread, then runs 8
+        // threads doing random malloc/free on the heap while bumping a
+        // counter under a second lock. No update may be lost, every call
+        // must take the heap lock exactly once and the heap must end as a
+        // single available block. Contention varies from run to run so
+        // only its consistency is shown.
+
+        void *p0 = el_malloc(100);
+        void *p1 = el_malloc(200);
+        el_free(p0);
+        el_free(p1);
+        el_print_lock_stats();
+
+        el_lock_init(&counter_lock);
+        pthread_t threads[8];
+        for (long i = 0; i < 8; i++) {
+            pthread_create(&threads[i], NULL, lock_worker, (void *) i);
+        }
+        for (int i = 0; i < 8; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        printf("counter: %ld  expected: %d\n", counter, 8 * LOCK_TEST_OPS);
+        printf("counter lock acquisitions: %lu\n", counter_lock.acquisitions);
+        el_lock_t *lock = &el_ctl.lock;
+        printf("heap lock acquisitions at least calls: %d\n",
+               lock->acquisitions >= 4 + 8 * LOCK_TEST_OPS);
+        printf("contended <= acquisitions: %d\n",
+               lock->contended <= lock->acquisitions);
+        printf("no sleeps without contention: %d\n",
+               lock->contended > 0 || lock->sleeps == 0);
+        printf("state: %d\n", lock->state);
+        el_print_stats();
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Aligned Malloc") == 0) {
+        PRINT_TEST;
+        // Odd sized blocks leave the next payload unaligned; aligned
+        // requests must split off the front and tail and give both back
+        // so freeing everything leaves one available block.
+
+        void *p0 = el_malloc(3);
+        void *a0 = el_malloc_aligned(24, EL_ALIGN);
+        void *p1 = el_malloc(5);
+        void *a1 = el_malloc_aligned(100, 64);
+        printf("p0 aligned: %d\n", (size_t) p0 % EL_ALIGN == 0);
+        printf("a0 aligned: %d  size >= 24: %d\n",
+               (size_t) a0 % EL_ALIGN == 0, el_usable_size(a0) >= 24);
+        printf("a1 aligned: %d  size >= 100: %d\n",
+               (size_t) a1 % 64 == 0, el_usable_size(a1) >= 100);
+        printf("below a1 is p1: %d\n", (void *) p1 < a1);
+        el_print_stats();
+        el_free(a0);
+        el_free(p0);
+        el_free(a1);
+        el_free(p1);
+        el_print_stats();
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Shadow Policies") == 0) {
+        PRINT_TEST;
+        // Replays every block of a pattern that leaves holes of mixed
+        // sizes against the simulated policies. Best fit should fill the
+        // small holes exactly and end with less extent than first fit.
+
+        printf("start: %d\n", el_shadow_start(0));
+        printf("start: %d\n", el_shadow_start(1));
+        void *ptrs[12];
+        size_t sizes[12] = {200, 40, 120, 40, 300, 40, 80, 40, 160, 40, 60, 40};
+        for (int i = 0; i < 12; i++) {
+            ptrs[i] = el_malloc(sizes[i]);
+        }
+        for (int i = 0; i < 12; i += 2) {
+            el_free(ptrs[i]);
+        }
+        size_t wants[6] = {50, 110, 70, 150, 190, 280};
+        for (int i = 0; i < 6; i++) {
+            ptrs[2 * i] = el_malloc(wants[i]);
+        }
+        el_shadow_stop();
+        el_free(el_malloc(10));          // not replayed
+        el_shadow_print_stats();
+        for (int i = 0; i < 12; i++) {
+            el_free(ptrs[i]);
+        }
+    } // ENDTEST
+
+    else if (strcmp(test_name, "Shadow Adjacent Frees") == 0) {
+        PRINT_TEST;
+        // Frees neighbouring blocks upwards, so each merges with the one
+        // below, then downwards, so each merges with the one above, and
+        // blocks between two free ones. Every simulated heap should end
+        // as one available block which an allocation of the whole extent
+        // reuses without growing.
+
+        printf("start: %d\n", el_shadow_start(1));
+        void *p[5];
+        size_t sizes[5] = {40, 80, 120, 160, 200};
+        for (int i = 0; i < 5; i++) {
+            p[i] = el_malloc(sizes[i]);
+        }
+        el_free(p[3]);
+        el_free(p[0]);
+        el_free(p[1]);
+        // the holes of d and of a and b merged both fit without growing
+        void *q0 = el_malloc(150);
+        void *q1 = el_malloc(150);
+        el_shadow_print_stats();
+        el_free(q0);
+        el_free(q1);
+        el_free(p[2]);
+        el_free(p[4]);
+        void *big = el_malloc(760);
+        el_shadow_print_stats();
+        el_free(big);
+
+        for (int i = 0; i < 5; i++) {
+            p[i] = el_malloc(sizes[i]);
+        }
+        el_free(p[1]);
+        el_free(p[0]);
+        el_free(p[4]);
+        el_free(p[3]);
+        el_free(p[2]);
+        big = el_malloc(760);
+        el_shadow_print_stats();
+        el_free(big);
+        el_shadow_stop();
+    } // ENDTEST
+
     else {
         printf("No test named '%s' found\n",test_name);
         return 1;